@@ -0,0 +1,168 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "common.h"
+#include "access_stats.h"
+#include "binary_file_writer.h"
+
+void AccessStats::Reset()
+{
+    memset(&m_current, 0, sizeof(m_current));
+    m_history.clear();
+}
+
+void AccessStats::EndFrame()
+{
+    if (m_history.size() >= m_history_limit)
+    {
+        m_history.pop_front();
+    }
+
+    m_history.push_back(m_current);
+    u32 next_frame = m_current.frame + 1;
+    memset(&m_current, 0, sizeof(m_current));
+    m_current.frame = next_frame;
+}
+
+void AccessStats::SetHistoryLimit(size_t limit)
+{
+    m_history_limit = std::max<size_t>(limit, 1);
+
+    while (m_history.size() > m_history_limit)
+    {
+        m_history.pop_front();
+    }
+}
+
+// Calls visit(region, index, access, count) for every non-zero counter.
+// Counters of the same region and access kind are visited consecutively.
+template <typename Visitor>
+void AccessStats::VisitCounters(const AccessFrameStats& frame, Visitor visit)
+{
+    auto visit_array = [&visit](const char* region, const char* access, const u32* counts, size_t size, unsigned int base)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            if (counts[i] != 0)
+            {
+                visit(region, base + (unsigned int)i, access, counts[i]);
+            }
+        }
+    };
+
+    visit_array("rom", "read", frame.rom_bank_reads.data(), frame.rom_bank_reads.size(), 0);
+    visit_array("sram", "read", frame.sram_bank_reads.data(), frame.sram_bank_reads.size(), 0);
+    visit_array("sram", "write", frame.sram_bank_writes.data(), frame.sram_bank_writes.size(), 0);
+    visit_array("vram", "read", frame.vram_bank_reads.data(), frame.vram_bank_reads.size(), 0);
+    visit_array("vram", "write", frame.vram_bank_writes.data(), frame.vram_bank_writes.size(), 0);
+    visit_array("wram", "read", frame.wram_bank_reads.data(), frame.wram_bank_reads.size(), 0);
+    visit_array("wram", "write", frame.wram_bank_writes.data(), frame.wram_bank_writes.size(), 0);
+    visit_array("hram", "read", &frame.hram_reads, 1, 0);
+    visit_array("hram", "write", &frame.hram_writes, 1, 0);
+    visit_array("oam", "read", &frame.oam_reads, 1, 0);
+    visit_array("oam", "write", &frame.oam_writes, 1, 0);
+    visit_array("mmio", "read", frame.mmio_reads.data(), frame.mmio_reads.size(), 0xFF00);
+    visit_array("mmio", "read", &frame.ie_reads, 1, 0xFFFF);
+    visit_array("mmio", "write", frame.mmio_writes.data(), frame.mmio_writes.size(), 0xFF00);
+    visit_array("mmio", "write", &frame.ie_writes, 1, 0xFFFF);
+    visit_array("mapper", "write", frame.mapper_reg_writes.data(), frame.mapper_reg_writes.size(), 0);
+}
+
+static bool WriteTextFile(const std::string& file_name, const std::string& text)
+{
+    BinaryFileWriter writer(file_name);
+
+    if (!writer.IsOpen())
+    {
+        return false;
+    }
+
+    return writer.WriteBytes(text.data(), text.size());
+}
+
+bool AccessStats::WriteCSV(const std::string& file_name) const
+{
+    std::string text = "frame,region,index,access,count\n";
+    char line[128];
+
+    for (const AccessFrameStats& frame : m_history)
+    {
+        VisitCounters(frame, [&](const char* region, unsigned int index, const char* access, u32 count)
+        {
+            snprintf(line, sizeof(line), "%u,%s,%X,%s,%u\n", frame.frame, region, index, access, count);
+            text += line;
+        });
+    }
+
+    return WriteTextFile(file_name, text);
+}
+
+bool AccessStats::WriteJSON(const std::string& file_name) const
+{
+    std::string text = "[";
+    char buf[128];
+
+    for (size_t i = 0; i < m_history.size(); i++)
+    {
+        const AccessFrameStats& frame = m_history[i];
+        const char* group_region = nullptr;
+        const char* group_access = nullptr;
+
+        snprintf(buf, sizeof(buf), "%s\n{\"frame\":%u", (i == 0) ? "" : ",", frame.frame);
+        text += buf;
+
+        VisitCounters(frame, [&](const char* region, unsigned int index, const char* access, u32 count)
+        {
+            bool new_group = (group_region == nullptr
+                || strcmp(region, group_region) != 0
+                || strcmp(access, group_access) != 0);
+
+            if (new_group)
+            {
+                if (group_region != nullptr)
+                {
+                    text += "}";
+                }
+
+                snprintf(buf, sizeof(buf), ",\"%s_%s\":{", region, access);
+                text += buf;
+                group_region = region;
+                group_access = access;
+            }
+
+            snprintf(buf, sizeof(buf), "%s\"%X\":%u", new_group ? "" : ",", index, count);
+            text += buf;
+        });
+
+        if (group_region != nullptr)
+        {
+            text += "}";
+        }
+
+        text += "}";
+    }
+
+    text += "\n]\n";
+
+    return WriteTextFile(file_name, text);
+}
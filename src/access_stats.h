@@ -0,0 +1,202 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <deque>
+#include <string>
+#include "common.h"
+
+// Access counting is compiled in only when GBEMU_ACCESS_STATS is defined.
+// Otherwise COUNT_ACCESS expands to nothing and its arguments are never evaluated.
+#ifdef GBEMU_ACCESS_STATS
+#define COUNT_ACCESS(hw, call) ((hw).access_stats.call)
+#else
+#define COUNT_ACCESS(hw, call) ((void)0)
+#endif
+
+const int access_stats_max_rom_banks = 512;
+const int access_stats_max_sram_banks = 16;
+const int access_stats_mmio_regs = 0x80;
+
+// Mapper control registers, selected by bits 14:13 of the write address.
+const int access_stats_mapper_regs = 4;
+
+// Frames kept in the history by default, about a minute. Each frame is about 3 KB.
+const size_t access_stats_default_history_limit = 3600;
+
+struct AccessFrameStats
+{
+    u32 frame;
+
+    std::array<u32, access_stats_max_rom_banks> rom_bank_reads;
+    std::array<u32, access_stats_max_sram_banks> sram_bank_reads;
+    std::array<u32, access_stats_max_sram_banks> sram_bank_writes;
+    std::array<u32, 2> vram_bank_reads;
+    std::array<u32, 2> vram_bank_writes;
+    std::array<u32, 8> wram_bank_reads;
+    std::array<u32, 8> wram_bank_writes;
+    u32 hram_reads;
+    u32 hram_writes;
+    u32 oam_reads;
+    u32 oam_writes;
+
+    // FF00-FF7F, indexed by the low 7 bits of the address
+    std::array<u32, access_stats_mmio_regs> mmio_reads;
+    std::array<u32, access_stats_mmio_regs> mmio_writes;
+    u32 ie_reads;
+    u32 ie_writes;
+
+    std::array<u32, access_stats_mapper_regs> mapper_reg_writes;
+};
+
+class AccessStats
+{
+public:
+    AccessStats() : m_history_limit(access_stats_default_history_limit)
+    {
+        Reset();
+    }
+
+    void Reset();
+
+    // Closes the current frame and appends it to the history, dropping the oldest frame if the
+    // history is full.
+    void EndFrame();
+
+    const AccessFrameStats& GetCurrentFrame() const
+    {
+        return m_current;
+    }
+
+    // The most recent frames, oldest first. Holds at most GetHistoryLimit() frames.
+    const std::deque<AccessFrameStats>& GetHistory() const
+    {
+        return m_history;
+    }
+
+    size_t GetHistoryLimit() const
+    {
+        return m_history_limit;
+    }
+
+    // Must be at least 1. Drops the oldest frames if the history is already longer.
+    void SetHistoryLimit(size_t limit);
+
+    void ClearHistory()
+    {
+        m_history.clear();
+    }
+
+    // One row per non-zero counter: frame,region,index,kind,count
+    bool WriteCSV(const std::string& file_name) const;
+
+    // An array with one object per frame, holding only non-zero counters.
+    bool WriteJSON(const std::string& file_name) const;
+
+    void CountROMRead(unsigned int bank)
+    {
+        m_current.rom_bank_reads[bank % access_stats_max_rom_banks]++;
+    }
+
+    void CountSRAMRead(unsigned int bank)
+    {
+        m_current.sram_bank_reads[bank % access_stats_max_sram_banks]++;
+    }
+
+    void CountSRAMWrite(unsigned int bank)
+    {
+        m_current.sram_bank_writes[bank % access_stats_max_sram_banks]++;
+    }
+
+    void CountVRAMRead(unsigned int bank)
+    {
+        m_current.vram_bank_reads[bank & 1]++;
+    }
+
+    void CountVRAMWrite(unsigned int bank)
+    {
+        m_current.vram_bank_writes[bank & 1]++;
+    }
+
+    void CountWRAMRead(unsigned int bank)
+    {
+        m_current.wram_bank_reads[bank & 7]++;
+    }
+
+    void CountWRAMWrite(unsigned int bank)
+    {
+        m_current.wram_bank_writes[bank & 7]++;
+    }
+
+    void CountHRAMRead()
+    {
+        m_current.hram_reads++;
+    }
+
+    void CountHRAMWrite()
+    {
+        m_current.hram_writes++;
+    }
+
+    void CountOAMRead()
+    {
+        m_current.oam_reads++;
+    }
+
+    void CountOAMWrite()
+    {
+        m_current.oam_writes++;
+    }
+
+    void CountMMIORead(u16 addr)
+    {
+        m_current.mmio_reads[addr & (access_stats_mmio_regs - 1)]++;
+    }
+
+    void CountMMIOWrite(u16 addr)
+    {
+        m_current.mmio_writes[addr & (access_stats_mmio_regs - 1)]++;
+    }
+
+    void CountIERead()
+    {
+        m_current.ie_reads++;
+    }
+
+    void CountIEWrite()
+    {
+        m_current.ie_writes++;
+    }
+
+    void CountMapperWrite(u16 addr)
+    {
+        m_current.mapper_reg_writes[(addr >> 13) & (access_stats_mapper_regs - 1)]++;
+    }
+
+private:
+    template <typename Visitor>
+    static void VisitCounters(const AccessFrameStats& frame, Visitor visit);
+
+    AccessFrameStats m_current;
+    std::deque<AccessFrameStats> m_history;
+    size_t m_history_limit;
+};
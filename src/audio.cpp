@@ -18,9 +18,11 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <algorithm>
 #include "common.h"
 #include "audio.h"
 #include "machine.h"
+#include "recorder.h"
 
 const std::array<u8, 4> duty_cycles =
 {
@@ -30,7 +32,26 @@ const std::array<u8, 4> duty_cycles =
     0b10000011,
 };
 
-const double sample_ratio = 2097152.0 / sample_rate;
+// Clocks per second that Update() is called with.
+const double apu_clock_rate = 2097152.0;
+
+// A blip frame ends once it's run this many clocks, about 1 ms.
+const u32 blip_frame_length = 2048;
+
+// Samples each blip buffer can hold, with room for Update() calls that run past the frame length.
+const size_t blip_capacity = 1024;
+
+// Samples written to the buffer at a time, about 1.3 ms of stereo.
+const size_t sample_block_size = 128;
+
+// Fraction of the distance to the current fill level that the smoothed level moves each blip
+// frame, for a time constant of about 200 ms.
+const double rate_control_smoothing = 0.005;
+
+const int pulse1_channel = 0;
+const int pulse2_channel = 1;
+const int wave_channel = 2;
+const int noise_channel = 3;
 
 u16 CalcPulsePeriod(u16 frequency)
 {
@@ -42,9 +63,137 @@ u16 CalcWavePeriod(u16 frequency)
     return 2048 - frequency;
 }
 
+u32 CalcNoisePeriod(u8 div_ratio, u8 shift_clock_frequency)
+{
+    u32 divisor = div_ratio ? div_ratio * 8 : 4;
+    return divisor << shift_clock_frequency;
+}
+
+// Runs a counter that reloads with period for a number of cycles, and returns how many times it
+// reached 0.
+static u32 AdvanceCounter(u32& counter, u32 period, u32 cycles)
+{
+    if (counter > cycles)
+    {
+        counter -= cycles;
+        return 0;
+    }
+
+    u32 remaining = cycles - counter;
+    counter = period - remaining % period;
+    return 1 + remaining / period;
+}
+
+static u16 StepLFSR(u16 lfsr, bool narrow)
+{
+    u16 right_xor = ((lfsr >> 1) & 1) ^ (lfsr & 1);
+    lfsr >>= 1;
+    lfsr |= (right_xor << 14);
+    if (narrow)
+    {
+        lfsr &= ~Bit(6);
+        lfsr |= (right_xor << 6);
+    }
+    return lfsr;
+}
+
+// Stepping the LFSR is linear over GF(2), so it can be written as a matrix, held as the image of
+// each of the 15 bits. Running it n steps is multiplying by that matrix to the nth power.
+using LFSRMatrix = std::array<u16, 15>;
+
+static u16 ApplyLFSRMatrix(const LFSRMatrix& matrix, u16 lfsr)
+{
+    u16 result = 0;
+
+    for (int i = 0; i < 15; i++)
+    {
+        if ((lfsr >> i) & 1)
+        {
+            result ^= matrix[i];
+        }
+    }
+
+    return result;
+}
+
+// Matrices for 2^i steps.
+static std::array<LFSRMatrix, 32> BuildLFSRJumps(bool narrow)
+{
+    std::array<LFSRMatrix, 32> jumps;
+
+    for (int i = 0; i < 15; i++)
+    {
+        jumps[0][i] = StepLFSR(Bit(i), narrow);
+    }
+
+    for (int j = 1; j < 32; j++)
+    {
+        for (int i = 0; i < 15; i++)
+        {
+            jumps[j][i] = ApplyLFSRMatrix(jumps[j - 1], jumps[j - 1][i]);
+        }
+    }
+
+    return jumps;
+}
+
+const std::array<LFSRMatrix, 32> wide_lfsr_jumps = BuildLFSRJumps(false);
+const std::array<LFSRMatrix, 32> narrow_lfsr_jumps = BuildLFSRJumps(true);
+
+static u16 JumpLFSR(u16 lfsr, bool narrow, u32 steps)
+{
+    const std::array<LFSRMatrix, 32>& jumps = narrow ? narrow_lfsr_jumps : wide_lfsr_jumps;
+
+    for (int j = 0; steps != 0; j++, steps >>= 1)
+    {
+        if (steps & 1)
+        {
+            lfsr = ApplyLFSRMatrix(jumps[j], lfsr);
+        }
+    }
+
+    return lfsr;
+}
+
+Audio::Audio(Hardware& hw) :
+    m_hw(hw),
+    m_blip_so1(blip_capacity),
+    m_blip_so2(blip_capacity),
+    m_blip_time(0),
+    m_sample_rate(default_sample_rate),
+    m_rate_adjustment(1.0),
+    m_rate_control_target(0),
+    m_average_buffered_samples(0),
+    m_channel_gains(),
+    m_channel_amplitudes(),
+    m_samples(max_buffered_samples),
+    m_recorder(nullptr)
+{
+    UpdateBlipRates();
+}
+
+void Audio::SetSampleRate(unsigned int rate)
+{
+    m_sample_rate = rate;
+    UpdateBlipRates();
+}
+
+void Audio::SetRateControlTarget(size_t buffered_samples)
+{
+    m_rate_control_target = buffered_samples;
+    m_average_buffered_samples = static_cast<double>(buffered_samples);
+    UpdateRateControl();
+}
+
 void Audio::Reset()
 {
+    m_blip_so1.Clear();
+    m_blip_so2.Clear();
+    m_blip_time = 0;
+    m_channel_amplitudes = {};
+
     m_total_cycles = 0;
+    m_synced_cycles = 0;
 
     m_audio_enable = false;
 
@@ -128,21 +277,8 @@ void Audio::Reset()
     m_so2_ch4_enable = false;
 
     m_wave_ram = {};
-}
-
-const std::vector<float>& Audio::GetSampleBuffer()
-{
-    return m_sample_buffer;
-}
 
-void Audio::ClearSampleBuffer()
-{
-    m_sample_buffer.clear();
-}
-
-void Audio::ConsumeSampleBuffer(size_t num_samples)
-{
-    m_sample_buffer.erase(m_sample_buffer.begin(), m_sample_buffer.begin() + num_samples);
+    UpdateMixer();
 }
 
 u8 Audio::ReadNR10()
@@ -152,6 +288,8 @@ u8 Audio::ReadNR10()
 
 void Audio::WriteNR10(u8 val)
 {
+    Sync();
+
     m_nr10_val = val;
     m_sweep_shift = val & 0x7;
     m_sweep_decreasing = (val >> 3) & 1;
@@ -165,9 +303,12 @@ u8 Audio::ReadNR11()
 
 void Audio::WriteNR11(u8 val)
 {
+    Sync();
+
     m_nr11_val = val;
     m_pulse1_length.counter = 64 - (val & 0x3F);
     m_pulse1_duty = val >> 6;
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR12()
@@ -177,6 +318,8 @@ u8 Audio::ReadNR12()
 
 void Audio::WriteNR12(u8 val)
 {
+    Sync();
+
     m_nr12_val = val;
     m_pulse1_envelope.period = val & 0x7;
     m_pulse1_envelope.increasing = (val >> 3) & 1;
@@ -190,6 +333,8 @@ u8 Audio::ReadNR13()
 
 void Audio::WriteNR13(u8 val)
 {
+    Sync();
+
     m_pulse1_frequency = (m_pulse1_frequency & 0x700) | val;
 }
 
@@ -200,6 +345,8 @@ u8 Audio::ReadNR14()
 
 void Audio::WriteNR14(u8 val)
 {
+    Sync();
+
     m_nr14_val = val;
     m_pulse1_frequency = ((val & 0x7) << 8) | (m_pulse1_frequency & 0xFF);
     m_pulse1_length.enabled = (val >> 6) & 1;
@@ -220,6 +367,8 @@ void Audio::WriteNR14(u8 val)
         m_sweep_counter = m_sweep_period;
         m_sweep_enabled = (m_sweep_period != 0) || (m_sweep_shift != 0);
     }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR21()
@@ -229,9 +378,12 @@ u8 Audio::ReadNR21()
 
 void Audio::WriteNR21(u8 val)
 {
+    Sync();
+
     m_nr21_val = val;
     m_pulse2_length.counter = 64 - (val & 0x3F);
     m_pulse2_duty = val >> 6;
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR22()
@@ -241,6 +393,8 @@ u8 Audio::ReadNR22()
 
 void Audio::WriteNR22(u8 val)
 {
+    Sync();
+
     m_nr22_val = val;
     m_pulse2_envelope.period = val & 0x7;
     m_pulse2_envelope.increasing = (val >> 3) & 1;
@@ -254,6 +408,8 @@ u8 Audio::ReadNR23()
 
 void Audio::WriteNR23(u8 val)
 {
+    Sync();
+
     m_pulse2_frequency = (m_pulse2_frequency & 0x700) | val;
 }
 
@@ -264,6 +420,8 @@ u8 Audio::ReadNR24()
 
 void Audio::WriteNR24(u8 val)
 {
+    Sync();
+
     m_nr24_val = val;
     m_pulse2_frequency = ((val & 0x7) << 8) | (m_pulse2_frequency & 0xFF);
     m_pulse2_length.enabled = (val >> 6) & 1;
@@ -281,6 +439,8 @@ void Audio::WriteNR24(u8 val)
         m_pulse2_envelope.counter = m_pulse2_envelope.period;
         m_pulse2_envelope.volume = m_pulse2_envelope.initial_volume;
     }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR30()
@@ -290,8 +450,17 @@ u8 Audio::ReadNR30()
 
 void Audio::WriteNR30(u8 val)
 {
+    Sync();
+
     m_nr30_val = val;
     m_wave_dac_enabled = (val >> 7) & 1;
+
+    if (!m_wave_dac_enabled)
+    {
+        m_wave_enabled = false;
+    }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR31()
@@ -301,6 +470,8 @@ u8 Audio::ReadNR31()
 
 void Audio::WriteNR31(u8 val)
 {
+    Sync();
+
     m_wave_length.counter = 256 - val;
 }
 
@@ -311,8 +482,11 @@ u8 Audio::ReadNR32()
 
 void Audio::WriteNR32(u8 val)
 {
+    Sync();
+
     m_nr32_val = val;
     m_wave_output_level = (val >> 5) & 0x3;
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR33()
@@ -322,6 +496,8 @@ u8 Audio::ReadNR33()
 
 void Audio::WriteNR33(u8 val)
 {
+    Sync();
+
     m_wave_frequency = (m_wave_frequency & 0x700) | val;
 }
 
@@ -332,6 +508,8 @@ u8 Audio::ReadNR34()
 
 void Audio::WriteNR34(u8 val)
 {
+    Sync();
+
     m_nr34_val = val;
     m_wave_frequency = ((val & 0x7) << 8) | (m_wave_frequency & 0xFF);
     m_wave_length.enabled = (val >> 6) & 1;
@@ -339,7 +517,7 @@ void Audio::WriteNR34(u8 val)
 
     if (restart)
     {
-        m_wave_enabled = true;
+        m_wave_enabled = m_wave_dac_enabled;
         if (m_wave_length.counter == 0)
         {
             m_wave_length.counter = 256;
@@ -347,6 +525,8 @@ void Audio::WriteNR34(u8 val)
         m_wave_counter = CalcWavePeriod(m_wave_frequency);
         m_wave_pos_counter = 0;
     }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR41()
@@ -356,6 +536,8 @@ u8 Audio::ReadNR41()
 
 void Audio::WriteNR41(u8 val)
 {
+    Sync();
+
     m_noise_length.counter = 64 - (val & 0x3F);
 }
 
@@ -366,6 +548,8 @@ u8 Audio::ReadNR42()
 
 void Audio::WriteNR42(u8 val)
 {
+    Sync();
+
     m_nr42_val = val;
     m_noise_envelope.period = val & 0x7;
     m_noise_envelope.increasing = (val >> 3) & 1;
@@ -379,6 +563,8 @@ u8 Audio::ReadNR43()
 
 void Audio::WriteNR43(u8 val)
 {
+    Sync();
+
     m_nr43_val = val;
     m_noise_div_ratio = val & 0x7;
     m_noise_narrow = (val >> 3) & 1;
@@ -392,6 +578,8 @@ u8 Audio::ReadNR44()
 
 void Audio::WriteNR44(u8 val)
 {
+    Sync();
+
     m_nr44_val = val;
     m_noise_length.enabled = (val >> 6) & 1;
     bool restart = (val >> 7) & 1;
@@ -406,8 +594,11 @@ void Audio::WriteNR44(u8 val)
         m_noise_envelope.enabled = true;
         m_noise_envelope.counter = m_noise_envelope.period;
         m_noise_envelope.volume = m_noise_envelope.initial_volume;
+        m_noise_counter = CalcNoisePeriod(m_noise_div_ratio, m_noise_shift_clock_frequency);
         m_noise_lfsr = 0x7FFF;
     }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR50()
@@ -417,9 +608,13 @@ u8 Audio::ReadNR50()
 
 void Audio::WriteNR50(u8 val)
 {
+    Sync();
+
     m_nr50_val = val;
     m_so1_volume = val & 0x7;
     m_so2_volume = (val >> 4) & 0x7;
+    UpdateMixer();
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR51()
@@ -429,6 +624,8 @@ u8 Audio::ReadNR51()
 
 void Audio::WriteNR51(u8 val)
 {
+    Sync();
+
     m_nr51_val = val;
     m_so1_ch1_enable = (val >> 0) & 1;
     m_so1_ch2_enable = (val >> 1) & 1;
@@ -438,6 +635,8 @@ void Audio::WriteNR51(u8 val)
     m_so2_ch2_enable = (val >> 5) & 1;
     m_so2_ch3_enable = (val >> 6) & 1;
     m_so2_ch4_enable = (val >> 7) & 1;
+    UpdateMixer();
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadNR52()
@@ -452,7 +651,11 @@ u8 Audio::ReadNR52()
 
 void Audio::WriteNR52(u8 val)
 {
+    Sync();
+
     m_audio_enable = (val >> 7) & 1;
+    UpdateMixer();
+    UpdateChannelOutputs(m_blip_time);
 }
 
 u8 Audio::ReadWaveRAM(u8 addr)
@@ -462,7 +665,10 @@ u8 Audio::ReadWaveRAM(u8 addr)
 
 void Audio::WriteWaveRAM(u8 addr, u8 val)
 {
+    Sync();
+
     m_wave_ram[addr] = val;
+    UpdateChannelOutputs(m_blip_time);
 }
 
 void Audio::UpdateLength(Length& length, bool& chan_enabled)
@@ -519,6 +725,8 @@ void Audio::UpdateEnvelope(Envelope& envelope)
 
 void Audio::TimerTick()
 {
+    Sync();
+
     if (!m_audio_enable)
     {
         return;
@@ -575,76 +783,126 @@ void Audio::TimerTick()
             }
         }
     }
+
+    UpdateChannelOutputs(m_blip_time);
 }
 
-void Audio::UpdatePulse1()
+void Audio::UpdatePulse1(u32 start, u32 end)
 {
-    if (m_pulse1_enabled)
+    if (!m_pulse1_enabled)
+    {
+        return;
+    }
+
+    if (IsChannelSilent(pulse1_channel, m_pulse1_envelope.volume))
     {
-        m_pulse1_counter--;
+        u32 edges = AdvanceCounter(m_pulse1_counter, CalcPulsePeriod(m_pulse1_frequency), end - start);
+        m_pulse1_duty_counter = (m_pulse1_duty_counter + edges) & 0x7;
+        return;
+    }
 
-        if (m_pulse1_counter == 0)
-        {
-            m_pulse1_counter = CalcPulsePeriod(m_pulse1_frequency);
+    u32 time = start + m_pulse1_counter;
 
-            m_pulse1_duty_counter++;
-            m_pulse1_duty_counter &= 0x7;
-        }
+    while (time <= end)
+    {
+        m_pulse1_counter = CalcPulsePeriod(m_pulse1_frequency);
+
+        m_pulse1_duty_counter++;
+        m_pulse1_duty_counter &= 0x7;
+
+        SetChannelOutput(pulse1_channel, GetPulse1Output(), time);
+        time += m_pulse1_counter;
     }
+
+    m_pulse1_counter = time - end;
 }
 
-void Audio::UpdatePulse2()
+void Audio::UpdatePulse2(u32 start, u32 end)
 {
-    if (m_pulse2_enabled)
+    if (!m_pulse2_enabled)
+    {
+        return;
+    }
+
+    if (IsChannelSilent(pulse2_channel, m_pulse2_envelope.volume))
     {
-        m_pulse2_counter--;
+        u32 edges = AdvanceCounter(m_pulse2_counter, CalcPulsePeriod(m_pulse2_frequency), end - start);
+        m_pulse2_duty_counter = (m_pulse2_duty_counter + edges) & 0x7;
+        return;
+    }
 
-        if (m_pulse2_counter == 0)
-        {
-            m_pulse2_counter = CalcPulsePeriod(m_pulse2_frequency);
+    u32 time = start + m_pulse2_counter;
 
-            m_pulse2_duty_counter++;
-            m_pulse2_duty_counter &= 0x7;
-        }
+    while (time <= end)
+    {
+        m_pulse2_counter = CalcPulsePeriod(m_pulse2_frequency);
+
+        m_pulse2_duty_counter++;
+        m_pulse2_duty_counter &= 0x7;
+
+        SetChannelOutput(pulse2_channel, GetPulse2Output(), time);
+        time += m_pulse2_counter;
     }
+
+    m_pulse2_counter = time - end;
 }
 
-void Audio::UpdateWave()
+void Audio::UpdateWave(u32 start, u32 end)
 {
-    if (m_wave_enabled)
+    if (!m_wave_enabled)
     {
-        m_wave_counter--;
+        return;
+    }
 
-        if (m_wave_counter == 0)
-        {
-            m_wave_counter = CalcWavePeriod(m_wave_frequency);
+    if (IsChannelSilent(wave_channel, m_wave_output_level))
+    {
+        u32 edges = AdvanceCounter(m_wave_counter, CalcWavePeriod(m_wave_frequency), end - start);
+        m_wave_pos_counter = (m_wave_pos_counter + edges) & 0x1F;
+        return;
+    }
 
-            m_wave_pos_counter++;
-            m_wave_pos_counter &= 0x1F;
-        }
+    u32 time = start + m_wave_counter;
+
+    while (time <= end)
+    {
+        m_wave_counter = CalcWavePeriod(m_wave_frequency);
+
+        m_wave_pos_counter++;
+        m_wave_pos_counter &= 0x1F;
+
+        SetChannelOutput(wave_channel, GetWaveOutput(), time);
+        time += m_wave_counter;
     }
+
+    m_wave_counter = time - end;
 }
 
-void Audio::UpdateNoise()
+void Audio::UpdateNoise(u32 start, u32 end)
 {
-    if (m_noise_enabled && m_noise_shift_clock_frequency < 14)
+    if (!m_noise_enabled || m_noise_shift_clock_frequency >= 14)
     {
-        m_noise_counter--;
+        return;
+    }
 
-        if (m_noise_counter == 0)
-        {
-            u16 div_ratio = m_noise_div_ratio ? m_noise_div_ratio * 8 : 4;
-            m_noise_counter = div_ratio << m_noise_shift_clock_frequency;
-            u16 right_xor = ((m_noise_lfsr >> 1) & 1) ^ (m_noise_lfsr & 1);
-            m_noise_lfsr >>= 1;
-            m_noise_lfsr |= (right_xor << 14);
-            if (m_noise_narrow)
-            {
-                m_noise_lfsr &= ~Bit(6);
-                m_noise_lfsr |= (right_xor << 6);
-            }
-        }
+    if (IsChannelSilent(noise_channel, m_noise_envelope.volume))
+    {
+        u32 edges = AdvanceCounter(m_noise_counter, CalcNoisePeriod(m_noise_div_ratio, m_noise_shift_clock_frequency), end - start);
+        m_noise_lfsr = JumpLFSR(m_noise_lfsr, m_noise_narrow, edges);
+        return;
     }
+
+    u32 time = start + m_noise_counter;
+
+    while (time <= end)
+    {
+        m_noise_counter = CalcNoisePeriod(m_noise_div_ratio, m_noise_shift_clock_frequency);
+        m_noise_lfsr = StepLFSR(m_noise_lfsr, m_noise_narrow);
+
+        SetChannelOutput(noise_channel, GetNoiseOutput(), time);
+        time += m_noise_counter;
+    }
+
+    m_noise_counter = time - end;
 }
 
 u8 Audio::GetPulse1Output()
@@ -697,73 +955,153 @@ u8 Audio::GetNoiseOutput()
     return 0;
 }
 
-void Audio::OutputSample()
+// A channel whose output is stuck at 0, or that isn't sent to either terminal, can't be heard.
+bool Audio::IsChannelSilent(int channel, u8 volume) const
 {
-    std::lock_guard<std::mutex> lock(m_sample_buffer_mutex);
+    return volume == 0 || (m_channel_gains[channel][0] == 0 && m_channel_gains[channel][1] == 0);
+}
 
-    if (!m_audio_enable)
+void Audio::UpdateMixer()
+{
+    std::array<bool, 4> so1_enables = {m_so1_ch1_enable, m_so1_ch2_enable, m_so1_ch3_enable, m_so1_ch4_enable};
+    std::array<bool, 4> so2_enables = {m_so2_ch1_enable, m_so2_ch2_enable, m_so2_ch3_enable, m_so2_ch4_enable};
+
+    // Each channel's output levels run from 0 to 15, and all four together at full volume
+    // make 1.
+    float so1_gain = m_audio_enable ? (m_so1_volume + 1) / (15.0f * 4 * 8) : 0;
+    float so2_gain = m_audio_enable ? (m_so2_volume + 1) / (15.0f * 4 * 8) : 0;
+
+    for (int channel = 0; channel < 4; channel++)
     {
-        m_sample_buffer.push_back(0);
-        m_sample_buffer.push_back(0);
-        return;
+        m_channel_gains[channel][0] = so1_enables[channel] ? so1_gain : 0;
+        m_channel_gains[channel][1] = so2_enables[channel] ? so2_gain : 0;
     }
+}
 
-    float pulse1_output = (float)GetPulse1Output() / 15;
-    float pulse2_output = (float)GetPulse2Output() / 15;
-    float wave_output = (float)GetWaveOutput() / 15;
-    float noise_output = (float)GetNoiseOutput() / 15;
+void Audio::UpdateChannelOutputs(u32 time)
+{
+    SetChannelOutput(pulse1_channel, GetPulse1Output(), time);
+    SetChannelOutput(pulse2_channel, GetPulse2Output(), time);
+    SetChannelOutput(wave_channel, GetWaveOutput(), time);
+    SetChannelOutput(noise_channel, GetNoiseOutput(), time);
+}
+
+void Audio::SetChannelOutput(int channel, u8 level, u32 time)
+{
+    float so1_amplitude = level * m_channel_gains[channel][0];
+    float so2_amplitude = level * m_channel_gains[channel][1];
 
-    float so1_output = 0;
+    if (so1_amplitude != m_channel_amplitudes[channel][0])
+    {
+        m_blip_so1.AddDelta(time, so1_amplitude - m_channel_amplitudes[channel][0]);
+        m_channel_amplitudes[channel][0] = so1_amplitude;
+    }
 
-    if (m_so1_ch1_enable) so1_output += pulse1_output;
-    if (m_so1_ch2_enable) so1_output += pulse2_output;
-    if (m_so1_ch3_enable) so1_output += wave_output;
-    if (m_so1_ch4_enable) so1_output += noise_output;
+    if (so2_amplitude != m_channel_amplitudes[channel][1])
+    {
+        m_blip_so2.AddDelta(time, so2_amplitude - m_channel_amplitudes[channel][1]);
+        m_channel_amplitudes[channel][1] = so2_amplitude;
+    }
+}
 
-    so1_output /= 4;
+void Audio::EndBlipFrame()
+{
+    m_blip_so1.EndFrame(m_blip_time);
+    m_blip_so2.EndFrame(m_blip_time);
+    m_blip_time = 0;
 
-    so1_output *= (m_so1_volume + 1) / 8;
+    // Both buffers have the same rate and frame times, so they always have the same number of
+    // samples ready.
+    size_t count = m_blip_so1.GetSamplesAvailable();
+    size_t block_pos = m_sample_block.size();
+    m_sample_block.resize(block_pos + count * 2);
+    m_blip_so1.ReadSamples(&m_sample_block[block_pos], count, 2);
+    m_blip_so2.ReadSamples(&m_sample_block[block_pos + 1], count, 2);
 
-    m_sample_buffer.push_back(so1_output);
+    if (m_sample_block.size() >= sample_block_size)
+    {
+        FlushSamples();
+    }
 
-    float so2_output = 0;
+    UpdateRateControl();
+}
 
-    if (m_so2_ch1_enable) so2_output += pulse1_output;
-    if (m_so2_ch2_enable) so2_output += pulse2_output;
-    if (m_so2_ch3_enable) so2_output += wave_output;
-    if (m_so2_ch4_enable) so2_output += noise_output;
+void Audio::UpdateRateControl()
+{
+    double adjustment = 1.0;
 
-    so2_output /= 4;
+    if (m_rate_control_target != 0 && m_recorder == nullptr)
+    {
+        double buffered = static_cast<double>(m_samples.GetSize());
+        m_average_buffered_samples += (buffered - m_average_buffered_samples) * rate_control_smoothing;
 
-    so2_output *= (m_so2_volume + 1) / 8;
+        // Make more samples while the buffer is below its target and fewer while it's above.
+        double error = 1.0 - m_average_buffered_samples / m_rate_control_target;
+        adjustment += max_rate_adjustment * std::clamp(error, -1.0, 1.0);
+    }
 
-    m_sample_buffer.push_back(so2_output);
+    if (adjustment != m_rate_adjustment)
+    {
+        m_rate_adjustment = adjustment;
+        UpdateBlipRates();
+    }
 }
 
-void Audio::Update(unsigned int cycles)
+void Audio::UpdateBlipRates()
 {
-    while (cycles > 0)
+    m_blip_so1.SetRates(apu_clock_rate, m_sample_rate * m_rate_adjustment);
+    m_blip_so2.SetRates(apu_clock_rate, m_sample_rate * m_rate_adjustment);
+}
+
+void Audio::SetRecorder(Recorder* recorder)
+{
+    FlushSamples();
+    m_recorder = recorder;
+    UpdateRateControl();
+}
+
+void Audio::FlushSamples()
+{
+    if (m_sample_block.empty())
     {
-        m_total_cycles++;
+        return;
+    }
 
-        if (!m_wave_dac_enabled)
-        {
-            m_wave_enabled = false;
-        }
+    // A block that doesn't fit is dropped whole, so the channels stay interleaved.
+    if (m_samples.GetWriteAvailable() >= m_sample_block.size())
+    {
+        m_samples.Write(m_sample_block.data(), m_sample_block.size());
+    }
 
-        UpdatePulse1();
-        UpdatePulse2();
-        UpdateWave();
-        UpdateNoise();
+    if (m_recorder != nullptr)
+    {
+        m_recorder->SubmitAudio(m_sample_block.data(), m_sample_block.size());
+    }
 
-        s64 prev_sample_num = (s64)((double)(m_total_cycles - 1) / sample_ratio);
-        s64 sample_num = (s64)((double)m_total_cycles / sample_ratio);
+    m_sample_block.clear();
+}
 
-        if (sample_num != prev_sample_num)
-        {
-            OutputSample();
-        }
+void Audio::Sync()
+{
+    u32 start = m_blip_time;
+    u32 end = m_blip_time + static_cast<u32>(m_total_cycles - m_synced_cycles);
+
+    UpdatePulse1(start, end);
+    UpdatePulse2(start, end);
+    UpdateWave(start, end);
+    UpdateNoise(start, end);
 
-        cycles--;
+    m_blip_time = end;
+    m_synced_cycles = m_total_cycles;
+}
+
+void Audio::Update(unsigned int cycles)
+{
+    m_total_cycles += cycles;
+
+    if (m_blip_time + (m_total_cycles - m_synced_cycles) >= blip_frame_length)
+    {
+        Sync();
+        EndBlipFrame();
     }
 }
@@ -22,31 +22,176 @@
 
 #include <array>
 #include <vector>
-#include <mutex>
+#include "blip_buffer.h"
 #include "common.h"
+#include "ring_buffer.h"
 
-const int sample_rate = 48000;
+const unsigned int default_sample_rate = 48000;
+
+// How far dynamic rate control can move the output rate from the one that was set.
+const double max_rate_adjustment = 0.005;
+
+// Samples (counting each channel) that can wait to be played, about 170 ms. Samples produced
+// while the buffer is full are dropped.
+const size_t max_buffered_samples = 16384;
 
 struct Hardware;
+class Recorder;
+
+// Mutable APU state. Kept trivially copyable so it can be snapshotted with a plain copy.
+struct AudioState
+{
+    struct Length
+    {
+        bool enabled;
+        u16 counter;
+    };
+
+    struct Envelope
+    {
+        u8 initial_volume;
+        u8 volume;
+        u8 counter;
+        u8 period;
+        bool increasing;
+        bool enabled;
+    };
+
+    u64 m_total_cycles;
+
+    // The channels have been run up to this many cycles. The rest are run by the next sync.
+    u64 m_synced_cycles;
+
+    bool m_audio_enable;
+
+    u8 m_timer_ticks;
+
+    // Pulse 1 sweep
+    bool m_sweep_enabled;
+    u16 m_sweep_frequency;
+    u8 m_sweep_shift;
+    bool m_sweep_decreasing;
+    u8 m_sweep_counter;
+    u8 m_sweep_period;
+
+    // Pulse 1 (channel 1)
+    bool m_pulse1_enabled;
+    Length m_pulse1_length;
+    u8 m_pulse1_duty;
+    Envelope m_pulse1_envelope;
+    u16 m_pulse1_frequency;
+    u32 m_pulse1_counter;
+    u8 m_pulse1_duty_counter;
+
+    // Pulse 2 (channel 2)
+    bool m_pulse2_enabled;
+    Length m_pulse2_length;
+    u8 m_pulse2_duty;
+    Envelope m_pulse2_envelope;
+    u16 m_pulse2_frequency;
+    u32 m_pulse2_counter;
+    u8 m_pulse2_duty_counter;
+
+    // Wave (channel 3)
+    bool m_wave_enabled;
+    bool m_wave_dac_enabled;
+    Length m_wave_length;
+    u8 m_wave_output_level;
+    u16 m_wave_frequency;
+    u32 m_wave_counter;
+    u16 m_wave_pos_counter;
+
+    // Noise (channel 4)
+    bool m_noise_enabled;
+    Length m_noise_length;
+    Envelope m_noise_envelope;
+    u8 m_noise_shift_clock_frequency;
+    bool m_noise_narrow;
+    u8 m_noise_div_ratio;
+    u32 m_noise_counter;
+    u16 m_noise_lfsr;
+
+    u8 m_nr10_val;
+    u8 m_nr11_val;
+    u8 m_nr12_val;
+    u8 m_nr14_val;
+
+    u8 m_nr21_val;
+    u8 m_nr22_val;
+    u8 m_nr24_val;
+
+    u8 m_nr30_val;
+    u8 m_nr32_val;
+    u8 m_nr34_val;
+
+    u8 m_nr42_val;
+    u8 m_nr43_val;
+    u8 m_nr44_val;
+
+    u8 m_nr50_val;
+    u8 m_nr51_val;
+
+    u8 m_so1_volume;
+    u8 m_so2_volume;
+
+    bool m_so1_ch1_enable;
+    bool m_so1_ch2_enable;
+    bool m_so1_ch3_enable;
+    bool m_so1_ch4_enable;
+    bool m_so2_ch1_enable;
+    bool m_so2_ch2_enable;
+    bool m_so2_ch3_enable;
+    bool m_so2_ch4_enable;
+
+    std::array<u8, 16> m_wave_ram;
+};
 
-class Audio
+class Audio : private AudioState
 {
 public:
-    explicit Audio(Hardware& hw) : m_hw(hw)
+    explicit Audio(Hardware& hw);
+
+    void Reset();
+
+    // Samples are interleaved stereo, left first. They're produced by the emulation thread and
+    // can be read by one other thread without locking.
+
+    // Reads up to count samples and returns how many were read.
+    size_t ReadSamples(float* samples, size_t count)
     {
+        return m_samples.Read(samples, count);
     }
 
-    void Reset();
+    // Samples waiting to be read. Can be called from either thread.
+    size_t GetBufferedSampleCount() const
+    {
+        return m_samples.GetSize();
+    }
 
-    const std::vector<float>& GetSampleBuffer();
-    void ClearSampleBuffer();
-    void ConsumeSampleBuffer(size_t num_samples);
+    // Sets the output rate in samples per second. Samples already buffered are left as they are.
+    void SetSampleRate(unsigned int rate);
 
-    std::mutex& GetSampleBufferMutex()
+    unsigned int GetSampleRate() const
     {
-        return m_sample_buffer_mutex;
+        return m_sample_rate;
     }
 
+    // Dynamic rate control. With a nonzero target, the output rate is nudged by up to
+    // max_rate_adjustment so the number of buffered samples settles around the target. This
+    // keeps the buffer from running dry or filling up when the reader's clock and emulation
+    // don't run at quite the same speed. Held off while recording, so the recording keeps its
+    // rate. Pass 0 to turn it off.
+    void SetRateControlTarget(size_t buffered_samples);
+
+    size_t GetRateControlTarget() const
+    {
+        return m_rate_control_target;
+    }
+
+    // Also sends samples to a recorder. Pass nullptr to stop, which sends the samples still
+    // waiting to the old recorder.
+    void SetRecorder(Recorder* recorder);
+
     u8 ReadNR10();
     void WriteNR10(u8 val);
 
@@ -115,127 +260,80 @@ public:
 
     void TimerTick();
 
+    // Only counts the cycles. The channels catch up when a register is written, on a timer
+    // tick, or when samples are due.
     void Update(unsigned int cycles);
 
-private:
-    struct Length
+    void SaveState(AudioState& state) const
     {
-        bool enabled;
-        u16 counter;
-    };
+        state = *this;
+    }
 
-    struct Envelope
+    void LoadState(const AudioState& state)
     {
-        u8 initial_volume;
-        u8 volume;
-        u8 counter;
-        u8 period;
-        bool increasing;
-        bool enabled;
-    };
+        static_cast<AudioState&>(*this) = state;
+        UpdateMixer();
+        UpdateChannelOutputs(m_blip_time);
+    }
 
+private:
     void UpdateLength(Length& length, bool& chan_enabled);
     void UpdateEnvelope(Envelope& envelope);
 
-    void UpdatePulse1();
-    void UpdatePulse2();
-    void UpdateWave();
-    void UpdateNoise();
+    // Runs the channels up to m_total_cycles.
+    void Sync();
+
+    // Run a channel from start to end, in clocks since the start of the blip frame. A channel
+    // that can be heard stops at each edge where its counter reloads, and one that can't skips
+    // the whole span at once.
+    void UpdatePulse1(u32 start, u32 end);
+    void UpdatePulse2(u32 start, u32 end);
+    void UpdateWave(u32 start, u32 end);
+    void UpdateNoise(u32 start, u32 end);
 
     u8 GetPulse1Output();
     u8 GetPulse2Output();
     u8 GetWaveOutput();
     u8 GetNoiseOutput();
 
-    void OutputSample();
+    bool IsChannelSilent(int channel, u8 volume) const;
+    void UpdateMixer();
+    void UpdateChannelOutputs(u32 time);
+    void SetChannelOutput(int channel, u8 level, u32 time);
+    void EndBlipFrame();
+    void FlushSamples();
+    void UpdateRateControl();
+    void UpdateBlipRates();
 
     Hardware& m_hw;
 
-    std::vector<float> m_sample_buffer;
-    std::mutex m_sample_buffer_mutex;
+    // SO1 and SO2. Channels add a delta whenever their output changes.
+    BlipBuffer m_blip_so1;
+    BlipBuffer m_blip_so2;
 
-    u64 m_total_cycles;
+    // Clocks since the start of the blip frame.
+    u32 m_blip_time;
 
-    bool m_audio_enable;
+    unsigned int m_sample_rate;
 
-    u8 m_timer_ticks;
+    // Scales m_sample_rate for dynamic rate control.
+    double m_rate_adjustment;
 
-    // Pulse 1 sweep
-    bool m_sweep_enabled;
-    u16 m_sweep_frequency;
-    u8 m_sweep_shift;
-    bool m_sweep_decreasing;
-    u8 m_sweep_counter;
-    u8 m_sweep_period;
+    size_t m_rate_control_target;
 
-    // Pulse 1 (channel 1)
-    bool m_pulse1_enabled;
-    Length m_pulse1_length;
-    u8 m_pulse1_duty;
-    Envelope m_pulse1_envelope;
-    u16 m_pulse1_frequency;
-    u16 m_pulse1_counter;
-    u8 m_pulse1_duty_counter;
+    // The reader takes samples in bursts, so the fill level is smoothed before it's used.
+    double m_average_buffered_samples;
 
-    // Pulse 2 (channel 2)
-    bool m_pulse2_enabled;
-    Length m_pulse2_length;
-    u8 m_pulse2_duty;
-    Envelope m_pulse2_envelope;
-    u16 m_pulse2_frequency;
-    u16 m_pulse2_counter;
-    u8 m_pulse2_duty_counter;
-
-    // Wave (channel 3)
-    bool m_wave_enabled;
-    bool m_wave_dac_enabled;
-    Length m_wave_length;
-    u8 m_wave_output_level;
-    u16 m_wave_frequency;
-    u16 m_wave_counter;
-    u16 m_wave_pos_counter;
-
-    // Noise (channel 4)
-    bool m_noise_enabled;
-    Length m_noise_length;
-    Envelope m_noise_envelope;
-    u8 m_noise_shift_clock_frequency;
-    bool m_noise_narrow;
-    u8 m_noise_div_ratio;
-    u16 m_noise_counter;
-    u16 m_noise_lfsr;
-
-    u8 m_nr10_val;
-    u8 m_nr11_val;
-    u8 m_nr12_val;
-    u8 m_nr14_val;
-
-    u8 m_nr21_val;
-    u8 m_nr22_val;
-    u8 m_nr24_val;
+    // Amplitude per output level of each channel on SO1 and SO2, from NR50, NR51 and NR52.
+    std::array<std::array<float, 2>, 4> m_channel_gains;
 
-    u8 m_nr30_val;
-    u8 m_nr32_val;
-    u8 m_nr34_val;
+    // Amplitude each channel last added to SO1 and SO2.
+    std::array<std::array<float, 2>, 4> m_channel_amplitudes;
 
-    u8 m_nr42_val;
-    u8 m_nr43_val;
-    u8 m_nr44_val;
-
-    u8 m_nr50_val;
-    u8 m_nr51_val;
+    // Samples are collected in a block and written out together, which keeps traffic on the
+    // reader's cache lines down and gives the recorder whole blocks.
+    std::vector<float> m_sample_block;
+    RingBuffer<float> m_samples;
 
-    u8 m_so1_volume;
-    u8 m_so2_volume;
-
-    bool m_so1_ch1_enable;
-    bool m_so1_ch2_enable;
-    bool m_so1_ch3_enable;
-    bool m_so1_ch4_enable;
-    bool m_so2_ch1_enable;
-    bool m_so2_ch2_enable;
-    bool m_so2_ch3_enable;
-    bool m_so2_ch4_enable;
-
-    std::array<u8, 16> m_wave_ram;
+    Recorder* m_recorder;
 };
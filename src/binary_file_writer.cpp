@@ -46,6 +46,21 @@ bool BinaryFileWriter::WriteBytes(const void* dest, size_t count)
     return m_ok;
 }
 
+bool BinaryFileWriter::Seek(long offset)
+{
+    if (m_file == nullptr)
+    {
+        return false;
+    }
+
+    if (fseek(m_file, offset, SEEK_SET) != 0)
+    {
+        m_ok = false;
+    }
+
+    return m_ok;
+}
+
 void BinaryFileWriter::Close()
 {
     if (m_file != nullptr)
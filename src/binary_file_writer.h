@@ -45,6 +45,9 @@ public:
 
     bool WriteBytes(const void* dest, size_t count);
 
+    // Moves to an offset from the start of the file, for going back to fill in a header.
+    bool Seek(long offset);
+
     void Close();
 
 private:
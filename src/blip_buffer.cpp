@@ -0,0 +1,128 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <algorithm>
+#include <cmath>
+#include "blip_buffer.h"
+
+const double pi = 3.14159265358979323846;
+
+// Cutoff as a fraction of the output sample rate, a little under Nyquist so the short kernel
+// still has room to roll off.
+const double kernel_cutoff = 0.45;
+
+// Where the DC filter starts to roll off.
+const double highpass_frequency = 20.0;
+
+BlipBuffer::BlipBuffer(size_t capacity) :
+    m_factor(0),
+    m_offset(0),
+    m_integrator(0),
+    m_leak(0),
+    m_kernels(num_phases * kernel_size),
+    m_buffer(capacity + kernel_size)
+{
+    const int half_size = kernel_size / 2;
+
+    // Each phase is a windowed-sinc impulse for a step a fraction of a sample past the first
+    // tap's center. Its taps sum to 1, so integrating it gives a step of exactly the delta.
+    for (int phase = 0; phase < num_phases; phase++)
+    {
+        float* kernel = &m_kernels[phase * kernel_size];
+        double sum = 0;
+
+        for (int i = 0; i < kernel_size; i++)
+        {
+            double x = i - (half_size - 1) - (double)phase / num_phases;
+            double window = 0.42 + 0.5 * cos(pi * x / half_size) + 0.08 * cos(2 * pi * x / half_size);
+            double sinc = (x == 0) ? 1.0 : sin(2 * pi * kernel_cutoff * x) / (2 * pi * kernel_cutoff * x);
+            kernel[i] = (float)(sinc * window);
+            sum += kernel[i];
+        }
+
+        for (int i = 0; i < kernel_size; i++)
+        {
+            kernel[i] = (float)(kernel[i] / sum);
+        }
+    }
+}
+
+void BlipBuffer::SetRates(double clock_rate, double sample_rate)
+{
+    m_factor = (u64)llround(sample_rate / clock_rate * (double)(1ULL << frac_bits));
+    m_leak = (float)(1.0 - exp(-2 * pi * highpass_frequency / sample_rate));
+}
+
+void BlipBuffer::Clear()
+{
+    m_offset = 0;
+    m_integrator = 0;
+    std::fill(m_buffer.begin(), m_buffer.end(), 0.0f);
+}
+
+void BlipBuffer::AddDelta(u32 time, float delta)
+{
+    u64 pos = m_offset + time * m_factor;
+    size_t index = static_cast<size_t>(pos >> frac_bits);
+
+    // Only happens if a frame runs longer than the capacity allows.
+    if (index + kernel_size > m_buffer.size())
+    {
+        return;
+    }
+
+    const float* kernel = &m_kernels[((pos >> (frac_bits - phase_bits)) & (num_phases - 1)) * kernel_size];
+    float* out = &m_buffer[index];
+
+    for (int i = 0; i < kernel_size; i++)
+    {
+        out[i] += kernel[i] * delta;
+    }
+}
+
+void BlipBuffer::EndFrame(u32 time)
+{
+    m_offset += time * m_factor;
+}
+
+size_t BlipBuffer::ReadSamples(float* samples, size_t count, size_t stride)
+{
+    size_t available = GetSamplesAvailable();
+    count = std::min(count, std::min(available, m_buffer.size() - kernel_size));
+
+    float integrator = m_integrator;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        integrator += m_buffer[i];
+        samples[i * stride] = integrator;
+        integrator -= integrator * m_leak;
+    }
+
+    m_integrator = integrator;
+
+    // Shift what's left, including the tails of steps near the end of the frame, to the front.
+    size_t used = std::min(available + kernel_size, m_buffer.size());
+    std::copy(m_buffer.begin() + count, m_buffer.begin() + used, m_buffer.begin());
+    std::fill(m_buffer.begin() + (used - count), m_buffer.begin() + used, 0.0f);
+    m_offset -= (u64)count << frac_bits;
+
+    return count;
+}
@@ -0,0 +1,83 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include "common.h"
+
+// Band-limited synthesis in the style of blip_buf. Changes in amplitude are added as deltas at
+// source clock times, and each one becomes a windowed-sinc step in the output, so square waves
+// resampled to the output rate don't alias.
+class BlipBuffer
+{
+public:
+    // Capacity is the most samples a frame can produce before they're read.
+    explicit BlipBuffer(size_t capacity);
+
+    BlipBuffer(const BlipBuffer&) = delete;
+    BlipBuffer& operator=(const BlipBuffer&) = delete;
+
+    // Sets how many samples are made per second of source clocks. Can be changed between frames.
+    void SetRates(double clock_rate, double sample_rate);
+
+    // Drops all samples and deltas and settles the output at 0.
+    void Clear();
+
+    // Adds a change in amplitude at a time in clocks since the start of the frame.
+    void AddDelta(u32 time, float delta);
+
+    // Ends the frame after the given number of clocks. Samples from before that time become
+    // available, and the next frame starts there.
+    void EndFrame(u32 time);
+
+    size_t GetSamplesAvailable() const
+    {
+        return static_cast<size_t>(m_offset >> frac_bits);
+    }
+
+    // Reads up to count samples, one every stride floats, and returns how many were read.
+    size_t ReadSamples(float* samples, size_t count, size_t stride);
+
+    // Taps in each step. Samples are delayed by half of this.
+    static constexpr int kernel_size = 16;
+
+private:
+    static constexpr int frac_bits = 32;
+    static constexpr int phase_bits = 6;
+    static constexpr int num_phases = 1 << phase_bits;
+
+    // Samples per clock, in 32.32 fixed point.
+    u64 m_factor;
+
+    // Position of the start of the frame in the buffer, in 32.32 fixed point.
+    u64 m_offset;
+
+    // Running sum of the deltas read so far, which is the output level.
+    float m_integrator;
+
+    // Fraction of the output level lost each sample, which filters out DC like the output
+    // capacitor does on hardware.
+    float m_leak;
+
+    std::vector<float> m_kernels;
+    std::vector<float> m_buffer;
+};
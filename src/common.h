@@ -34,3 +34,14 @@ typedef uint32_t u32;
 typedef uint64_t u64;
 
 #define Bit(n) (1 << (n))
+
+// SIMD code paths. MSVC doesn't define __SSE2__, but SSE2 is always available on x64 and with
+// /arch:SSE2 on x86. AVX2 is only used when the build enables it (see GBEMU_AVX2 in
+// CMakeLists.txt), since not every x64 CPU has it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GBEMU_SSE2
+#endif
+
+#if defined(__AVX2__)
+#define GBEMU_AVX2
+#endif
@@ -31,7 +31,49 @@ const unsigned int intr_serial = Bit(3);
 const unsigned int intr_joypad = Bit(4);
 const unsigned int intr_all = 0x1F;
 
-class CPU
+// Mutable CPU state. Kept trivially copyable so it can be snapshotted with a plain copy.
+struct CPUState
+{
+    union RegisterPair
+    {
+        u16 word;
+        u8 byte[2];
+    };
+
+    enum class IMEState
+    {
+        Stable,
+        EnableRequested,
+        EnableNow,
+    };
+
+    enum class HaltState
+    {
+        Off,
+        On,
+        Bug,
+    };
+
+    RegisterPair m_reg_af, m_reg_bc, m_reg_de, m_reg_hl; // general registers
+    u16 m_reg_sp; // stack pointer
+    u16 m_reg_pc; // program counter
+
+    HaltState m_halt_state;
+
+    bool m_ime; // interrupt master enable
+    IMEState m_ime_state;
+    u8 m_reg_if; // interrupt request flags
+    u8 m_reg_ie; // interrupt enable flags
+
+    bool m_double_speed;
+    bool m_should_switch_speed;
+
+    unsigned int m_instruction_cycles;
+
+    int m_cycles_left;
+};
+
+class CPU : private CPUState
 {
 public:
     explicit CPU(Hardware& hw) : m_hw(hw)
@@ -57,27 +99,17 @@ public:
 
     void SetTraceLogEnabled(bool enabled);
 
-private:
-    union RegisterPair
-    {
-        u16 word;
-        u8 byte[2];
-    };
-
-    enum class IMEState
+    void SaveState(CPUState& state) const
     {
-        Stable,
-        EnableRequested,
-        EnableNow,
-    };
+        state = *this;
+    }
 
-    enum class HaltState
+    void LoadState(const CPUState& state)
     {
-        Off,
-        On,
-        Bug,
-    };
+        static_cast<CPUState&>(*this) = state;
+    }
 
+private:
     void AddCycles(unsigned int cycles);
 
     u8 ReadMem8(u16 addr);
@@ -182,23 +214,5 @@ private:
 
     Hardware& m_hw;
 
-    RegisterPair m_reg_af, m_reg_bc, m_reg_de, m_reg_hl; // general registers
-    u16 m_reg_sp; // stack pointer
-    u16 m_reg_pc; // program counter
-
-    HaltState m_halt_state;
-
-    bool m_ime; // interrupt master enable
-    IMEState m_ime_state;
-    u8 m_reg_if; // interrupt request flags
-    u8 m_reg_ie; // interrupt enable flags
-
-    bool m_double_speed;
-    bool m_should_switch_speed;
-
-    unsigned int m_instruction_cycles;
-
-    int m_cycles_left;
-
     bool m_trace_log_enabled;
 };
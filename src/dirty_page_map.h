@@ -0,0 +1,102 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include "common.h"
+
+const size_t dirty_page_size = 256;
+
+enum class MemoryRegion
+{
+    WRAM,
+    VRAM,
+    OAM,
+    HRAM,
+    CartRAM,
+};
+
+// Bitmap of the pages in a memory region that were written since the host last cleared it.
+class DirtyPageMap
+{
+public:
+    static const size_t max_region_size = 0x20000;
+    static const size_t max_pages = max_region_size / dirty_page_size;
+
+    explicit DirtyPageMap(size_t region_size = 0)
+    {
+        SetRegionSize(region_size);
+    }
+
+    void SetRegionSize(size_t region_size)
+    {
+        m_page_count = (region_size + dirty_page_size - 1) / dirty_page_size;
+        MarkAll();
+    }
+
+    size_t GetPageCount() const
+    {
+        return m_page_count;
+    }
+
+    void Mark(size_t offset)
+    {
+        size_t page = offset / dirty_page_size;
+        m_bits[page >> 6] |= (u64)1 << (page & 63);
+    }
+
+    void MarkAll()
+    {
+        m_bits = {};
+
+        for (size_t page = 0; page < m_page_count; page++)
+        {
+            m_bits[page >> 6] |= (u64)1 << (page & 63);
+        }
+    }
+
+    void Clear()
+    {
+        m_bits = {};
+    }
+
+    bool IsDirty(size_t page) const
+    {
+        return (m_bits[page >> 6] >> (page & 63)) & 1;
+    }
+
+    bool IsAnyDirty() const
+    {
+        for (u64 word : m_bits)
+        {
+            if (word != 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    std::array<u64, max_pages / 64> m_bits;
+    size_t m_page_count;
+};
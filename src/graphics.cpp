@@ -61,54 +61,39 @@ const int oam_search_cycles = 20 * 2;
 const int pixel_transfer_cycles = 43 * 2;
 const int scanline_cycles = 114 * 2;
 
-const int total_sprites = 40;
-const int per_line_sprite_limit = 10;
-const int oam_entry_size = 4;
-
-// OAM entry offsets
-const int oam_y = 0;
-const int oam_x = 1;
-const int oam_tile_num = 2;
-const int oam_attr = 3;
-
-// OAM attributes
-
-const int oam_attr_cgb_pal_shift = 0;
-const int oam_attr_vram_bank_shift = 3;
-const int oam_attr_dmg_pal_shift = 4;
-const int oam_attr_flip_x_shift = 5;
-const int oam_attr_flip_y_shift = 6;
-const int oam_attr_priority_shift = 7;
-
-const unsigned int oam_attr_cgb_pal_mask = 0x7;
-const unsigned int oam_attr_vram_bank_mask = 0x1;
-const unsigned int oam_attr_dmg_pal_mask = 0x1;
-
-const unsigned int oam_attr_flip_x = Bit(oam_attr_flip_x_shift);
-const unsigned int oam_attr_flip_y = Bit(oam_attr_flip_y_shift);
-const unsigned int oam_attr_priority = Bit(oam_attr_priority_shift);
-
-// BG attributes
-
-const int bg_attr_pal_shift = 0;
-const int bg_attr_vram_bank_shift = 3;
-const int bg_attr_flip_x_shift = 5;
-const int bg_attr_flip_y_shift = 6;
-const int bg_attr_priority_shift = 7;
-
-const unsigned int bg_attr_pal_mask = 0x7;
-const unsigned int bg_attr_vram_bank_mask = 0x1;
-
-const unsigned int bg_attr_flip_x = Bit(bg_attr_flip_x_shift);
-const unsigned int bg_attr_flip_y = Bit(bg_attr_flip_y_shift);
-const unsigned int bg_attr_priority = Bit(bg_attr_priority_shift);
+// Dots (4 MHz) from the start of pixel transfer until the first pixel is output.
+const int pixel_transfer_first_pixel_dots = 12;
+
+Graphics::Graphics(Hardware& hw) :
+    m_hw(hw),
+    m_vram_dirty(sizeof(m_vram)),
+    m_oam_dirty(sizeof(m_oam)),
+    m_video_mode(VideoMode::Always),
+    m_frame_requested(false),
+    m_render_frame(false),
+    m_renderer_memory_stale(false),
+    m_rendered_frame_count(0),
+    m_completed_frame_count(0),
+    m_pixel_format(PixelFormat::XRGB8888),
+    m_renderer(hw.is_cgb_mode),
+    m_color_table(GetDefaultColorTable()),
+    m_line_changed(false),
+    m_line_registers(),
+    m_line_window_line(0),
+    m_line_window_counted(false)
+{
+}
 
 void Graphics::Reset()
 {
     m_vram = {};
     m_oam = {};
+    m_vram_dirty.MarkAll();
+    m_oam_dirty.MarkAll();
+    m_renderer.LoadMemory(m_vram, m_oam);
+    m_renderer_memory_stale = false;
 
-    m_vram_map = &m_vram[0];
+    m_vram_map_offset = 0;
     m_vram_bank = 0;
 
     m_bg_enable = true;
@@ -158,19 +143,50 @@ void Graphics::Reset()
 
     m_cycles_left = 0;
 
-    WhiteOutFramebuffers();
+    m_line_changed = false;
 
-    m_current_framebuffer = 0;
+    m_renderer.ClearFramebuffers();
+    StartFrame();
 
-    m_bg_color_indices = {};
-    m_bg_high_priority = {};
+    UpdateHostPalette();
+}
+
+void Graphics::SetPixelFormat(PixelFormat format)
+{
+    m_pixel_format = format;
+    m_renderer.SetPixelFormat(format);
+    UpdateHostPalette();
+}
+
+void Graphics::SetColorTable(std::shared_ptr<const ColorTable> table)
+{
+    m_color_table = std::move(table);
+    UpdateHostPalette();
+}
+
+void Graphics::SaveState(GraphicsState& state) const
+{
+    state = *this;
+}
+
+void Graphics::LoadState(const GraphicsState& state)
+{
+    static_cast<GraphicsState&>(*this) = state;
+    WriteVBK(m_vram_bank);
+    UpdateTilemapSelection();
+    m_vram_dirty.MarkAll();
+    m_oam_dirty.MarkAll();
+    m_renderer.LoadMemory(m_vram, m_oam);
+    m_renderer_memory_stale = false;
+    m_line_changed = false;
+    UpdateHostPalette();
 }
 
 u8 Graphics::ReadVRAM(u16 addr)
 {
     if (m_display_mode != DisplayMode::PixelTransfer)
     {
-        return m_vram_map[addr];
+        return m_vram[m_vram_map_offset + addr];
     }
 
     return 0xFF;
@@ -180,7 +196,17 @@ void Graphics::WriteVRAM(u16 addr, u8 val)
 {
     if (m_display_mode != DisplayMode::PixelTransfer)
     {
-        m_vram_map[addr] = val;
+        m_vram[m_vram_map_offset + addr] = val;
+        m_vram_dirty.Mark(m_vram_map_offset + addr);
+
+        if (m_render_frame)
+        {
+            m_renderer.WriteVRAM(m_vram_map_offset + addr, val);
+        }
+        else
+        {
+            m_renderer_memory_stale = true;
+        }
     }
 }
 
@@ -199,6 +225,16 @@ void Graphics::WriteOAM(u16 addr, u8 val)
     if (m_display_mode == DisplayMode::VBlank || m_display_mode == DisplayMode::HBlank)
     {
         m_oam[addr] = val;
+        m_oam_dirty.Mark(addr);
+
+        if (m_render_frame)
+        {
+            m_renderer.WriteOAM(addr, val);
+        }
+        else
+        {
+            m_renderer_memory_stale = true;
+        }
     }
 }
 
@@ -239,11 +275,13 @@ void Graphics::WriteLCDC(u8 val)
         {
             m_ly = 0;
             m_display_mode = DisplayMode::HBlank;
+            m_line_changed = false;
             WhiteOutFramebuffers();
         }
     }
 
     UpdateTilemapSelection();
+    RecordLineChange();
 }
 
 u8 Graphics::ReadSTAT()
@@ -272,6 +310,7 @@ u8 Graphics::ReadSCY()
 void Graphics::WriteSCY(u8 val)
 {
     m_scy = val;
+    RecordLineChange();
 }
 
 u8 Graphics::ReadSCX()
@@ -282,6 +321,7 @@ u8 Graphics::ReadSCX()
 void Graphics::WriteSCX(u8 val)
 {
     m_scx = val;
+    RecordLineChange();
 }
 
 u8 Graphics::ReadLY()
@@ -306,7 +346,15 @@ void Graphics::WriteDMA(u8 val)
     for (u16 i = 0; i < m_oam.size(); i++)
     {
         m_oam[i] = m_hw.memory.Read(((u16)val << 8) + i);
+
+        if (m_render_frame)
+        {
+            m_renderer.WriteOAM(i, m_oam[i]);
+        }
     }
+
+    m_oam_dirty.MarkAll();
+    m_renderer_memory_stale |= !m_render_frame;
 }
 
 u8 ReadPalette(std::array<u8, 4>& pal)
@@ -322,6 +370,20 @@ void WritePalette(std::array<u8, 4>& pal, u8 val)
     pal[3] = (val >> 6) & 0x3;
 }
 
+// The palette registers only affect drawing in DMG mode, so only then do writes that change them
+// reach the renderer.
+void Graphics::WriteDMGPaletteRegister(std::array<u8, 4>& pal, u8 val)
+{
+    bool changed = !m_hw.is_cgb_mode && val != ReadPalette(pal);
+    WritePalette(pal, val);
+
+    if (changed)
+    {
+        RecordLineChange(true);
+        UpdateHostPaletteDMG();
+    }
+}
+
 u8 Graphics::ReadBGP()
 {
     return ReadPalette(m_bgp);
@@ -329,7 +391,7 @@ u8 Graphics::ReadBGP()
 
 void Graphics::WriteBGP(u8 val)
 {
-    WritePalette(m_bgp, val);
+    WriteDMGPaletteRegister(m_bgp, val);
 }
 
 u8 Graphics::ReadOBP0()
@@ -339,7 +401,7 @@ u8 Graphics::ReadOBP0()
 
 void Graphics::WriteOBP0(u8 val)
 {
-    WritePalette(m_obp[0], val);
+    WriteDMGPaletteRegister(m_obp[0], val);
 }
 
 u8 Graphics::ReadOBP1()
@@ -349,7 +411,7 @@ u8 Graphics::ReadOBP1()
 
 void Graphics::WriteOBP1(u8 val)
 {
-    WritePalette(m_obp[1], val);
+    WriteDMGPaletteRegister(m_obp[1], val);
 }
 
 u8 Graphics::ReadWY()
@@ -370,6 +432,7 @@ u8 Graphics::ReadWX()
 void Graphics::WriteWX(u8 val)
 {
     m_wx = val;
+    RecordLineChange();
 }
 
 u8 Graphics::ReadVBK()
@@ -380,7 +443,7 @@ u8 Graphics::ReadVBK()
 void Graphics::WriteVBK(u8 val)
 {
     m_vram_bank = val & vbk_mask;
-    m_vram_map = &m_vram[m_vram_bank * 0x2000];
+    m_vram_map_offset = m_vram_bank * 0x2000;
 }
 
 void Graphics::WriteHDMA1(u8 val)
@@ -468,6 +531,8 @@ void Graphics::WriteBCPD(u8 val)
     if (m_display_mode != DisplayMode::PixelTransfer)
     {
         m_bcp[m_bcp_index] = val;
+        UpdateHostPaletteCGB(0, m_bcp, m_bcp_index);
+
         if (m_bcp_auto_increment)
         {
             m_bcp_index++;
@@ -502,6 +567,8 @@ void Graphics::WriteOCPD(u8 val)
     if (m_display_mode != DisplayMode::PixelTransfer)
     {
         m_ocp[m_ocp_index] = val;
+        UpdateHostPaletteCGB(obj_palette_entry_base, m_ocp, m_ocp_index);
+
         if (m_ocp_auto_increment)
         {
             m_ocp_index++;
@@ -564,24 +631,24 @@ void Graphics::UpdateTilemapSelection()
 {
     if (m_bg_tilemap_select == BG_TILEMAP_9800)
     {
-        m_bg_tilemap = &m_vram[0x1800];
-        m_bg_attr_table = &m_vram[0x3800];
+        m_bg_tilemap_offset = 0x1800;
+        m_bg_attr_table_offset = 0x3800;
     }
     else
     {
-        m_bg_tilemap = &m_vram[0x1C00];
-        m_bg_attr_table = &m_vram[0x3C00];
+        m_bg_tilemap_offset = 0x1C00;
+        m_bg_attr_table_offset = 0x3C00;
     }
 
     if (m_window_tilemap_select == WINDOW_TILEMAP_9800)
     {
-        m_window_tilemap = &m_vram[0x1800];
-        m_window_attr_table = &m_vram[0x3800];
+        m_window_tilemap_offset = 0x1800;
+        m_window_attr_table_offset = 0x3800;
     }
     else
     {
-        m_window_tilemap = &m_vram[0x1C00];
-        m_window_attr_table = &m_vram[0x3C00];
+        m_window_tilemap_offset = 0x1C00;
+        m_window_attr_table_offset = 0x3C00;
     }
 }
 
@@ -589,6 +656,11 @@ void Graphics::EnterModeHBlank()
 {
     m_display_mode = DisplayMode::HBlank;
     m_cycles_left += hblank_cycles;
+    if (m_line_changed)
+    {
+        m_renderer.RedrawChangedLine();
+        m_line_changed = false;
+    }
     DoHBlankDMA();
     if (m_mode0_intr_enable)
     {
@@ -605,7 +677,14 @@ void Graphics::EnterModeVBlank()
     {
         m_hw.cpu.SetInterruptFlag(intr_lcdc_status);
     }
-    RefreshScreen();
+    if (m_render_frame)
+    {
+        m_rendered_frame_count++;
+        m_renderer.EndFrame(m_rendered_frame_count);
+        m_frame_requested = false;
+    }
+    m_completed_frame_count++;
+    COUNT_ACCESS(m_hw, EndFrame());
 }
 
 void Graphics::EnterModeOAMSearch()
@@ -616,13 +695,56 @@ void Graphics::EnterModeOAMSearch()
     {
         m_hw.cpu.SetInterruptFlag(intr_lcdc_status);
     }
+    if (m_ly == 0)
+    {
+        StartFrame();
+    }
+}
+
+void Graphics::StartFrame()
+{
+    switch (m_video_mode)
+    {
+    case VideoMode::Always:
+        m_render_frame = true;
+        break;
+    case VideoMode::OnDemand:
+        // The request stays pending until a frame is completed, in case this one is cut
+        // short by the display being switched off.
+        m_render_frame = m_frame_requested;
+        break;
+    case VideoMode::Off:
+        m_render_frame = false;
+        break;
+    }
+
+    if (m_render_frame)
+    {
+        // Writes made while frames weren't being drawn never reached the renderer, so it takes
+        // a fresh copy of VRAM and OAM, and everything it caches is rebuilt.
+        if (m_renderer_memory_stale)
+        {
+            m_renderer.LoadMemory(m_vram, m_oam);
+            m_renderer_memory_stale = false;
+        }
+
+        m_renderer.BeginFrame();
+    }
 }
 
 void Graphics::EnterModePixelTransfer()
 {
     m_display_mode = DisplayMode::PixelTransfer;
     m_cycles_left += pixel_transfer_cycles;
-    DrawScanline();
+    if (m_render_frame)
+    {
+        DrawScanline();
+    }
+    else if (m_window_enable && IsWindowVisibleOnLine())
+    {
+        // The window line counter is PPU state, so it advances whether or not the line is drawn.
+        m_window_line++;
+    }
 }
 
 void Graphics::CompareLYWithLYC()
@@ -668,14 +790,11 @@ void Graphics::DoHBlankDMA()
     }
 }
 
+// Blanks the screen when the LCD is switched off, by publishing a cleared frame.
 void Graphics::WhiteOutFramebuffers()
 {
-    m_framebuffers = {};
-}
-
-void Graphics::RefreshScreen()
-{
-    m_current_framebuffer ^= 1;
+    m_rendered_frame_count++;
+    m_renderer.ClearFrame(m_rendered_frame_count);
 }
 
 u32 Graphics::GetRGBColor_DMG(unsigned int pixel, const std::array<u8, 4>& pal)
@@ -690,299 +809,221 @@ unsigned int Convert5To8(unsigned int val)
     return (val * 255 + 15) / 31;
 }
 
+std::shared_ptr<const ColorTable> GetDefaultColorTable()
+{
+    static const std::shared_ptr<const ColorTable> default_table = []()
+    {
+        auto table = std::make_shared<ColorTable>();
+
+        for (unsigned int rgb15 = 0; rgb15 < table->size(); rgb15++)
+        {
+            unsigned int r8 = Convert5To8((rgb15 >> 0) & 0x1F);
+            unsigned int g8 = Convert5To8((rgb15 >> 5) & 0x1F);
+            unsigned int b8 = Convert5To8((rgb15 >> 10) & 0x1F);
+            (*table)[rgb15] = (r8 << 16) | (g8 << 8) | b8;
+        }
+
+        return table;
+    }();
+
+    return default_table;
+}
+
 u32 Graphics::GetRGBColor_CGB(unsigned int pixel, const std::array<u8, 64>& pal, unsigned int pal_slot)
 {
     int offset = (pal_slot * 8) + (pixel * 2);
     u16 rgb16 = ((u16)pal[offset + 1] << 8) | pal[offset];
-    unsigned int r5 = (rgb16 >> 0) & 0x1F;
-    unsigned int g5 = (rgb16 >> 5) & 0x1F;
-    unsigned int b5 = (rgb16 >> 10) & 0x1F;
-    unsigned int r8 = Convert5To8(r5);
-    unsigned int g8 = Convert5To8(g5);
-    unsigned int b8 = Convert5To8(b5);
-    return (r8 << 16) | (g8 << 8) | b8;
+    return (*m_color_table)[rgb16 & 0x7FFF];
 }
 
-void Graphics::GetBackgroundPixelPlanes(
-    u8* tilemap,
-    unsigned int tile_x,
-    unsigned int tile_y,
-    unsigned int tile_fine_y,
-    unsigned int vram_bank,
-    bool flip_y,
-    u8& plane1,
-    u8& plane2)
+u32 Graphics::ConvertToPixelFormat(u32 rgb)
 {
-    if (flip_y)
+    unsigned int r = (rgb >> 16) & 0xFF;
+    unsigned int g = (rgb >> 8) & 0xFF;
+    unsigned int b = rgb & 0xFF;
+
+    switch (m_pixel_format)
     {
-        tile_fine_y = (tile_height - 1) - tile_fine_y;
+    case PixelFormat::XRGB8888:
+    case PixelFormat::Indexed8:
+        break;
+    case PixelFormat::ABGR8888:
+        return 0xFF000000 | (b << 16) | (g << 8) | r;
+    case PixelFormat::RGB565:
+        return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
     }
 
-    u8 tile_num = tilemap[(tile_y * virtual_screen_width) + tile_x];
-    unsigned int offset;
+    return rgb;
+}
 
-    if (m_pattern_table_select)
+// The value the renderer is given for a palette entry: the color in the output format, or for
+// Indexed8, the color with the index pixels using the entry are written as.
+u32 Graphics::GetHostPaletteValue(u32 rgb, unsigned int index)
+{
+    if (m_pixel_format == PixelFormat::Indexed8)
     {
-        // 8000-8FFF
-        offset = (tile_num * 16) + (tile_fine_y * 2);
+        return (index << 24) | rgb;
     }
-    else
+
+    return ConvertToPixelFormat(rgb);
+}
+
+void Graphics::UpdateHostPaletteDMG()
+{
+    if (m_hw.is_cgb_mode)
     {
-        // 8800-97FF
-        offset = 0x1000 + ((s8)tile_num * 16) + (tile_fine_y * 2);
+        return;
     }
 
-    offset += vram_bank * 0x2000;
-
-    plane1 = m_vram[offset];
-    plane2 = m_vram[offset + 1];
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        m_renderer.SetPaletteEntry(i, GetHostPaletteValue(GetRGBColor_DMG(i, m_bgp), m_bgp[i]));
+        m_renderer.SetPaletteEntry(obj_palette_entry_base + i,
+            GetHostPaletteValue(GetRGBColor_DMG(i, m_obp[0]), obj_palette_entry_base + m_obp[0][i]));
+        m_renderer.SetPaletteEntry(obj_palette_entry_base + 4 + i,
+            GetHostPaletteValue(GetRGBColor_DMG(i, m_obp[1]), obj_palette_entry_base + 4 + m_obp[1][i]));
+    }
 }
 
-unsigned int Graphics::GetPixelFromPlanes(u8 plane1, u8 plane2, unsigned int fine_x, bool flip_x)
+void Graphics::UpdateHostPaletteCGB(unsigned int entry_base, const std::array<u8, 64>& pal, unsigned int index)
 {
-    unsigned int shift = flip_x ? fine_x : (tile_width - 1) - fine_x;
-    return ((plane1 >> shift) & 1) | (((plane2 >> shift) << 1) & 2);
+    if (!m_hw.is_cgb_mode)
+    {
+        return;
+    }
+
+    // Each color is two bytes, so index / 2 is the palette entry (slot * 4 + color).
+    unsigned int entry = index / 2;
+    m_renderer.SetPaletteEntry(entry_base + entry,
+        GetHostPaletteValue(GetRGBColor_CGB(entry & 3, pal, entry >> 2), entry_base + entry));
 }
 
-void Graphics::DrawBackground_Helper(
-    FramebufferArray& fb,
-    u8* tilemap,
-    u8* attr_table,
-    unsigned int x,
-    unsigned int tile_x,
-    unsigned int tile_fine_x,
-    unsigned int tile_y,
-    unsigned int tile_fine_y)
+void Graphics::UpdateHostPalette()
 {
-    u8 attr = 0;
-
-    for (;;)
+    if (m_hw.is_cgb_mode)
     {
-        if (m_hw.is_cgb_mode)
+        for (unsigned int i = 0; i < 64; i += 2)
         {
-            attr = attr_table[(tile_y * virtual_screen_width) + tile_x];
+            UpdateHostPaletteCGB(0, m_bcp, i);
+            UpdateHostPaletteCGB(obj_palette_entry_base, m_ocp, i);
         }
-
-        unsigned int pal_slot = (attr >> bg_attr_pal_shift) & bg_attr_pal_mask;
-        unsigned int vram_bank = (attr >> bg_attr_vram_bank_shift) & bg_attr_vram_bank_mask;
-        bool flip_x = ((attr & bg_attr_flip_x) != 0);
-        bool flip_y = ((attr & bg_attr_flip_y) != 0);
-        bool high_priority = ((attr & bg_attr_priority) != 0);
-
-        u8 plane1, plane2;
-        GetBackgroundPixelPlanes(tilemap, tile_x, tile_y, tile_fine_y, vram_bank, flip_y, plane1, plane2);
-
-        for (;;)
+    }
+    else
+    {
+        // The DMG palettes only use a few entries; the rest, including the blank entry, are black.
+        for (unsigned int entry = 0; entry < 64; entry++)
         {
-            unsigned int pixel = GetPixelFromPlanes(plane1, plane2, tile_fine_x, flip_x);
-
-            m_bg_color_indices[x] = pixel;
-            m_bg_high_priority[x] = high_priority;
-
-            if (m_hw.is_cgb_mode)
-            {
-                fb[(m_ly * lcd_width) + x] = GetRGBColor_CGB(pixel, m_bcp, pal_slot);
-            }
-            else
-            {
-                fb[(m_ly * lcd_width) + x] = GetRGBColor_DMG(pixel, m_bgp);
-            }
-
-            if (x == lcd_width - 1)
-            {
-                return;
-            }
+            m_renderer.SetPaletteEntry(entry, GetHostPaletteValue(0, entry));
+        }
 
-            x++;
+        // Indexed8 frames hold shades, so each shade's color is set up front, as if the palette
+        // registers mapped every color to itself.
+        if (m_pixel_format == PixelFormat::Indexed8)
+        {
+            const std::array<u8, 4> shades = { 0, 1, 2, 3 };
 
-            if (tile_fine_x == tile_width - 1)
+            for (unsigned int i = 0; i < 4; i++)
             {
-                if (tile_x == virtual_screen_width - 1)
-                {
-                    tile_x = 0;
-                }
-                else
-                {
-                    tile_x++;
-                }
-
-                tile_fine_x = 0;
-                break;
+                u32 rgb = GetRGBColor_DMG(i, shades);
+                m_renderer.SetPaletteEntry(i, GetHostPaletteValue(rgb, i));
+                m_renderer.SetPaletteEntry(obj_palette_entry_base + i,
+                    GetHostPaletteValue(rgb, obj_palette_entry_base + i));
+                m_renderer.SetPaletteEntry(obj_palette_entry_base + 4 + i,
+                    GetHostPaletteValue(rgb, obj_palette_entry_base + 4 + i));
             }
-
-            tile_fine_x++;
         }
+
+        UpdateHostPaletteDMG();
     }
 }
 
-void Graphics::DrawBackground(FramebufferArray& fb)
+bool Graphics::IsWindowVisibleOnLine()
 {
-    unsigned int line = (m_ly + m_scy) & 0xFF;
-
-    unsigned int tile_x = m_scx >> 3;
-    unsigned int tile_fine_x = m_scx & 7;
-
-    unsigned int tile_y = line >> 3;
-    unsigned int tile_fine_y = line & 7;
-
-    DrawBackground_Helper(fb, m_bg_tilemap, m_bg_attr_table, 0, tile_x, tile_fine_x, tile_y, tile_fine_y);
+    return m_ly >= m_latched_wy && m_wx - 7 < lcd_width;
 }
 
-void Graphics::DrawWindow(FramebufferArray& fb)
+static bool IsSameLineRegisters(const LineRegisters& a, const LineRegisters& b)
 {
-    if (m_ly < m_latched_wy)
-    {
-        return;
-    }
-
-    int window_x = m_wx - 7;
-
-    if (window_x >= 160)
-    {
-        return;
-    }
-
-    int x = (window_x > 0) ? window_x : 0;
-    unsigned int window_x_offset = x - window_x;
-
-    unsigned int tile_x = window_x_offset >> 3;
-    unsigned int tile_fine_x = window_x_offset & 7;
-
-    unsigned int tile_y = m_window_line >> 3;
-    unsigned int tile_fine_y = m_window_line & 7;
-
-    m_window_line++;
-
-    DrawBackground_Helper(fb, m_window_tilemap, m_window_attr_table, x, tile_x, tile_fine_x, tile_y, tile_fine_y);
+    return a.ly == b.ly && a.scx == b.scx && a.scy == b.scy && a.wx == b.wx && a.window_line == b.window_line
+        && a.bg_enable == b.bg_enable && a.window_visible == b.window_visible && a.sprite_enable == b.sprite_enable
+        && a.sprite_size_8x16 == b.sprite_size_8x16 && a.pattern_table_8000 == b.pattern_table_8000
+        && a.bg_tilemap_offset == b.bg_tilemap_offset && a.bg_attr_table_offset == b.bg_attr_table_offset
+        && a.window_tilemap_offset == b.window_tilemap_offset
+        && a.window_attr_table_offset == b.window_attr_table_offset;
 }
 
-void Graphics::WhiteOutScanline(FramebufferArray& fb)
+LineRegisters Graphics::CaptureLineRegisters()
 {
-    for (int x = 0; x < lcd_width; x++)
-    {
-        fb[(m_ly * lcd_width) + x] = 0;
-        m_bg_color_indices[x] = 0;
-    }
+    LineRegisters regs;
+    regs.ly = m_ly;
+    regs.scx = m_scx;
+    regs.scy = m_scy;
+    regs.wx = m_wx;
+    regs.window_line = m_line_window_line;
+    regs.bg_enable = m_bg_enable;
+    regs.window_visible = m_window_enable && IsWindowVisibleOnLine();
+    regs.sprite_enable = m_sprite_enable;
+    regs.sprite_size_8x16 = (m_sprite_size == SPRITE_SIZE_8X16);
+    regs.pattern_table_8000 = (m_pattern_table_select == PATTERN_TABLE_8000);
+    regs.bg_tilemap_offset = m_bg_tilemap_offset;
+    regs.bg_attr_table_offset = m_bg_attr_table_offset;
+    regs.window_tilemap_offset = m_window_tilemap_offset;
+    regs.window_attr_table_offset = m_window_attr_table_offset;
+    return regs;
 }
 
+// Records the registers the line depends on, for the renderer to draw it from.
 void Graphics::DrawScanline()
 {
-    FramebufferArray& fb = m_framebuffers[m_current_framebuffer];
-
-    if (m_bg_enable || m_hw.is_cgb_mode)
-    {
-        DrawBackground(fb);
-    }
-    else
-    {
-        WhiteOutScanline(fb);
-    }
+    m_line_window_line = m_window_line;
+    LineRegisters regs = CaptureLineRegisters();
+    m_line_window_counted = regs.window_visible;
+    m_line_changed = false;
+    m_line_registers = regs;
 
-    if (m_window_enable)
+    if (regs.window_visible)
     {
-        DrawWindow(fb);
+        m_window_line++;
     }
 
-    if (m_sprite_enable)
-    {
-        DrawSprites(fb);
-    }
+    m_renderer.DrawLine(regs);
 }
 
-void Graphics::DrawSprites(FramebufferArray& fb)
+// Called after writes to registers that affect drawing. Lines are drawn when pixel transfer
+// starts, so a write in the middle of it has the renderer redraw the line pixel by pixel from
+// about where the PPU had got to. Lines without such writes keep the fast path, as do writes that
+// leave the registers as the line is already drawn with. palette_changed is set for DMG palette
+// writes, which the renderer applies from the x of the last change recorded.
+void Graphics::RecordLineChange(bool palette_changed)
 {
-    const int sprite_height = (m_sprite_size == SPRITE_SIZE_8X16) ? 16 : 8;
+    if (m_display_mode != DisplayMode::PixelTransfer || !m_render_frame)
+    {
+        return;
+    }
 
-    int count = 0;
-    std::array<int, total_sprites> potentially_visible_sprites;
+    int elapsed_cycles = pixel_transfer_cycles - m_cycles_left;
+    int x = std::max((elapsed_cycles * 2) - pixel_transfer_first_pixel_dots, 0);
 
-    for (int i = 0; i < total_sprites; i++)
+    if (x >= lcd_width)
     {
-        int sprite_y = m_oam[i * oam_entry_size + oam_y] - 16;
-
-        if (m_ly >= sprite_y && m_ly < sprite_y + sprite_height)
-        {
-            potentially_visible_sprites[count++] = i;
-        }
+        return;
     }
 
-    if (!m_hw.is_cgb_mode)
+    LineRegisters regs = CaptureLineRegisters();
+
+    if (!palette_changed && IsSameLineRegisters(regs, m_line_registers))
     {
-        std::stable_sort(
-            potentially_visible_sprites.begin(),
-            potentially_visible_sprites.begin() + count,
-            [this](int i, int j)
-            {
-                return m_oam[i * oam_entry_size + oam_x] < m_oam[j * oam_entry_size + oam_x];
-            });
+        return;
     }
 
-    for (int i = std::min(count, per_line_sprite_limit) - 1; i >= 0; i--)
+    // The window line counter advances on lines where the window is shown at all.
+    if (regs.window_visible && !m_line_window_counted)
     {
-        unsigned int sprite_index = potentially_visible_sprites[i];
-        unsigned int oam_offset = sprite_index * oam_entry_size;
-
-        int sprite_y = m_oam[oam_offset + oam_y] - 16;
-        int sprite_x = m_oam[oam_offset + oam_x] - 8;
-        u8 tile_num = m_oam[oam_offset + oam_tile_num];
-        u8 attr = m_oam[oam_offset + oam_attr];
-
-        if (m_sprite_size == SPRITE_SIZE_8X16)
-        {
-            tile_num &= ~1;
-        }
-
-        unsigned int cgb_pal_slot = (attr >> oam_attr_cgb_pal_shift) & oam_attr_cgb_pal_mask;
-        unsigned int vram_bank = m_hw.is_cgb_mode ? ((attr >> oam_attr_vram_bank_shift) & oam_attr_vram_bank_mask) : 0;
-        std::array<u8, 4>& dmg_pal = m_obp[(attr >> oam_attr_dmg_pal_shift) & oam_attr_dmg_pal_mask];
-        bool flip_x = ((attr & oam_attr_flip_x) != 0);
-        bool flip_y = ((attr & oam_attr_flip_y) != 0);
-        bool low_priority = ((attr & oam_attr_priority) != 0);
-
-        unsigned int sprite_line = m_ly - sprite_y;
-
-        if (flip_y)
-        {
-            sprite_line = (sprite_height - 1) - sprite_line;
-        }
-
-        unsigned int vram_offset = (vram_bank * 0x2000) + (tile_num * 16) + (sprite_line * 2);
-        u8 plane1 = m_vram[vram_offset];
-        u8 plane2 = m_vram[vram_offset + 1];
-
-        int x;
-        int fine_x;
-
-        if (sprite_x < 0)
-        {
-            x = 0;
-            fine_x = -sprite_x;
-        }
-        else
-        {
-            x = sprite_x;
-            fine_x = 0;
-        }
-
-
-        while (x < lcd_width && fine_x < tile_width)
-        {
-            unsigned int pixel = GetPixelFromPlanes(plane1, plane2, fine_x, flip_x);
-
-            if (pixel != 0 && (!m_bg_enable || (!m_bg_high_priority[x] && !low_priority) || m_bg_color_indices[x] == 0))
-            {
-                if (m_hw.is_cgb_mode)
-                {
-                    fb[(m_ly * lcd_width) + x] = GetRGBColor_CGB(pixel, m_ocp, cgb_pal_slot);
-                }
-                else
-                {
-                    fb[(m_ly * lcd_width) + x] = GetRGBColor_DMG(pixel, dmg_pal);
-                }
-            }
-
-            x++;
-            fine_x++;
-        }
+        m_window_line++;
+        m_line_window_counted = true;
     }
+
+    m_renderer.ChangeLineRegisters(x, regs);
+    m_line_registers = regs;
+    m_line_changed = true;
 }
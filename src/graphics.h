@@ -21,27 +21,232 @@
 #pragma once
 
 #include <array>
+#include <memory>
 #include "common.h"
+#include "dirty_page_map.h"
+#include "renderer.h"
 
-const int lcd_width = 160;
-const int lcd_height = 144;
+// Host colors (0xRRGGBB) for every 15-bit CGB color, indexed by the little-endian value stored in
+// palette RAM. Replacing the table applies color correction without any per-pixel cost.
+using ColorTable = std::array<u32, 0x8000>;
 
-using FramebufferArray = std::array<u32, lcd_width * lcd_height>;
+// Plain 5-bit to 8-bit scaling with no correction.
+std::shared_ptr<const ColorTable> GetDefaultColorTable();
+
+// Which frames are drawn into the framebuffer. PPU timing, STAT, LY and interrupts are the same
+// in every mode; frames that aren't drawn leave the framebuffer unchanged.
+enum class VideoMode
+{
+    // Draw every frame.
+    Always,
+    // Draw a frame only if RequestFrame() was called before it started.
+    OnDemand,
+    // Never draw.
+    Off,
+};
 
 struct Hardware;
 
-class Graphics
+// Mutable PPU state. Kept trivially copyable so it can be snapshotted with a plain copy.
+// VRAM banks and tilemaps are stored as offsets into m_vram and resolved at access time.
+struct GraphicsState
+{
+    enum SpriteSize
+    {
+        SPRITE_SIZE_8X8 = 0,
+        SPRITE_SIZE_8X16 = 1
+    };
+
+    enum BGTilemapSelect
+    {
+        BG_TILEMAP_9800 = 0,
+        BG_TILEMAP_9C00 = 1
+    };
+
+    enum PatternTableSelect
+    {
+        PATTERN_TABLE_8800 = 0,
+        PATTERN_TABLE_8000 = 1
+    };
+
+    enum WindowTilemapSelect
+    {
+        WINDOW_TILEMAP_9800 = 0,
+        WINDOW_TILEMAP_9C00 = 1
+    };
+
+    enum class DisplayMode
+    {
+        HBlank = 0,
+        VBlank = 1,
+        OAMSearch = 2,
+        PixelTransfer = 3
+    };
+
+    std::array<u8, 0x4000> m_vram; // video RAM
+    std::array<u8, 0xA0> m_oam;    // object attribute memory
+
+    u16 m_vram_map_offset;
+    int m_vram_bank;
+
+    // LCDC
+    bool m_bg_enable;
+    bool m_sprite_enable;
+    SpriteSize m_sprite_size;
+    BGTilemapSelect m_bg_tilemap_select;
+    PatternTableSelect m_pattern_table_select;
+    bool m_window_enable;
+    WindowTilemapSelect m_window_tilemap_select;
+    bool m_display_enable;
+
+    // STAT
+    DisplayMode m_display_mode;
+    bool m_coincidence_flag;
+    bool m_mode0_intr_enable;
+    bool m_mode1_intr_enable;
+    bool m_mode2_intr_enable;
+    bool m_coincidence_intr_enable;
+
+    u8 m_scy;
+    u8 m_scx;
+
+    u8 m_ly;
+    u8 m_lyc;
+
+    std::array<u8, 4> m_bgp;
+    std::array<std::array<u8, 4>, 2> m_obp;
+
+    u8 m_wy;
+    u8 m_wx;
+
+    u16 m_hdma_src;
+    u16 m_hdma_dest;
+    bool m_hdma_active;
+    int m_hdma_length;
+
+    bool m_bcp_auto_increment;
+    int m_bcp_index;
+    std::array<u8, 64> m_bcp;
+    bool m_ocp_auto_increment;
+    int m_ocp_index;
+    std::array<u8, 64> m_ocp;
+
+    u16 m_bg_tilemap_offset;
+    u16 m_bg_attr_table_offset;
+    u16 m_window_tilemap_offset;
+    u16 m_window_attr_table_offset;
+
+    u8 m_latched_wy;
+    u8 m_window_line;
+
+    int m_cycles_left;
+};
+
+class Graphics : private GraphicsState
 {
 public:
-    explicit Graphics(Hardware& hw) : m_hw(hw)
+    explicit Graphics(Hardware& hw);
+
+    void Reset();
+
+    void SetColorTable(std::shared_ptr<const ColorTable> table);
+
+    void SetVideoMode(VideoMode mode)
     {
+        m_video_mode = mode;
     }
 
-    void Reset();
+    void RequestFrame()
+    {
+        m_frame_requested = true;
+    }
+
+    // Number of frames drawn and made available through AcquireFrame(). Only to be read from
+    // the thread running the machine.
+    u64 GetRenderedFrameCount() const
+    {
+        return m_rendered_frame_count;
+    }
+
+    // Number of times VBlank has been entered, whether or not the frame was drawn.
+    u64 GetCompletedFrameCount() const
+    {
+        return m_completed_frame_count;
+    }
+
+    // Draws frames on a worker thread, which replays a log of the writes and register values
+    // that each line depends on while the emulation carries on. Frames then become available
+    // through AcquireFrame() a little later, and a host framebuffer is only up to date after
+    // SyncRenderer(). Off by default.
+    void SetRenderThreadEnabled(bool enabled)
+    {
+        m_renderer.SetThreaded(enabled);
+    }
+
+    // Waits for the render thread to finish everything up to the current point in emulation.
+    void SyncRenderer()
+    {
+        m_renderer.Sync();
+    }
+
+    // Clears the framebuffers and draws subsequent frames in the given format. Must not be called
+    // while another thread is reading frames.
+    void SetPixelFormat(PixelFormat format);
+
+    // Draws scanlines directly into host memory, with rows pitch bytes apart, instead of the
+    // internal framebuffers, which then aren't updated. Pass nullptr to go back to the internal
+    // framebuffers. The memory must stay valid until it is replaced.
+    void SetHostFramebuffer(void* pixels, unsigned int pitch)
+    {
+        m_renderer.SetHostFramebuffer(pixels, pitch);
+    }
+
+    // Draws frames as a width x height image with one byte per pixel, in rows width bytes
+    // apart, instead of full-size frames. Frames are still published, with stale pixels, and
+    // the host framebuffer isn't drawn. The image is complete once a frame has been drawn
+    // (followed by SyncRenderer() if the render thread is enabled). The size can be at most
+    // lcd_width x lcd_height. Returns false if it isn't. Pass nullptr to go back to full frames.
+    // The memory must stay valid until it is replaced.
+    bool SetObservationBuffer(u8* buffer, unsigned int width, unsigned int height, ObservationFormat format)
+    {
+        return m_renderer.SetObservationBuffer(buffer, width, height, format);
+    }
+
+    // Describes each drawn frame in grid, which is complete at the same point as an
+    // observation. Mid-line register changes aren't reflected. Pass nullptr to stop. The memory
+    // must stay valid until it is replaced.
+    void SetTileGrid(TileGrid* grid)
+    {
+        m_renderer.SetTileGrid(grid);
+    }
+
+    PixelFormat GetPixelFormat() const
+    {
+        return m_pixel_format;
+    }
 
-    const FramebufferArray& GetFramebuffer() const
+    unsigned int GetFramebufferPitch() const
     {
-        return m_framebuffers[m_current_framebuffer ^ 1];
+        return m_renderer.GetFramebufferPitch();
+    }
+
+    // Returns the most recently completed frame. It may be called from a different thread than
+    // the one running the machine, and it never waits for or blocks that thread. The frame stays
+    // valid until the next call.
+    const Frame& AcquireFrame()
+    {
+        return m_renderer.AcquireFrame();
+    }
+
+    const FramebufferArray& GetFramebuffer()
+    {
+        return AcquireFrame().pixels;
+    }
+
+    // The palette of the frame last returned by AcquireFrame() or GetFramebuffer().
+    const FramebufferPalette& GetFramebufferPalette() const
+    {
+        return m_renderer.GetFramebufferPalette();
     }
 
     u8 ReadVRAM(u16 addr);
@@ -112,143 +317,74 @@ public:
 
     void Update(unsigned int cycles);
 
-private:
-    enum SpriteSize
-    {
-        SPRITE_SIZE_8X8 = 0,
-        SPRITE_SIZE_8X16 = 1
-    };
-
-    enum BGTilemapSelect
-    {
-        BG_TILEMAP_9800 = 0,
-        BG_TILEMAP_9C00 = 1
-    };
+    void SaveState(GraphicsState& state) const;
+    void LoadState(const GraphicsState& state);
 
-    enum PatternTableSelect
+    const DirtyPageMap& GetVRAMDirtyPages() const
     {
-        PATTERN_TABLE_8800 = 0,
-        PATTERN_TABLE_8000 = 1
-    };
+        return m_vram_dirty;
+    }
 
-    enum WindowTilemapSelect
+    const DirtyPageMap& GetOAMDirtyPages() const
     {
-        WINDOW_TILEMAP_9800 = 0,
-        WINDOW_TILEMAP_9C00 = 1
-    };
+        return m_oam_dirty;
+    }
 
-    enum class DisplayMode
+    void ClearDirtyPages()
     {
-        HBlank = 0,
-        VBlank = 1,
-        OAMSearch = 2,
-        PixelTransfer = 3
-    };
-
-    static const int virtual_screen_width = 32;
-    static const int virtual_screen_height = 32;
-    static const int tile_width = 8;
-    static const int tile_height = 8;
+        m_vram_dirty.Clear();
+        m_oam_dirty.Clear();
+    }
 
+private:
     void UpdateTilemapSelection();
     void EnterModeHBlank();
     void EnterModeVBlank();
     void EnterModeOAMSearch();
+    void StartFrame();
     void EnterModePixelTransfer();
     void CompareLYWithLYC();
     void DoHBlankDMA();
     void WhiteOutFramebuffers();
-    void RefreshScreen();
     u32 GetRGBColor_DMG(unsigned int pixel, const std::array<u8, 4>& pal);
     u32 GetRGBColor_CGB(unsigned int pixel, const std::array<u8, 64>& pal, unsigned int pal_slot);
-    void GetBackgroundPixelPlanes(
-        u8* tilemap,
-        unsigned int tile_x,
-        unsigned int tile_y,
-        unsigned int tile_fine_y,
-        unsigned int vram_bank,
-        bool flip_y,
-        u8& plane1,
-        u8& plane2);
-    unsigned int GetPixelFromPlanes(u8 plane1, u8 plane2, unsigned int fine_x, bool flip_x);
-    void DrawBackground_Helper(
-        FramebufferArray& fb,
-        u8* tilemap,
-        u8* attr_table,
-        unsigned int x,
-        unsigned int tile_x,
-        unsigned int tile_fine_x,
-        unsigned int tile_y,
-        unsigned int tile_fine_y);
-    void DrawBackground(FramebufferArray& fb);
-    void DrawWindow(FramebufferArray& fb);
-    void DrawSprites(FramebufferArray& fb);
-    void WhiteOutScanline(FramebufferArray& fb);
+    u32 ConvertToPixelFormat(u32 rgb);
+    u32 GetHostPaletteValue(u32 rgb, unsigned int index);
+    void UpdateHostPaletteDMG();
+    void UpdateHostPaletteCGB(unsigned int entry_base, const std::array<u8, 64>& pal, unsigned int index);
+    void UpdateHostPalette();
+    bool IsWindowVisibleOnLine();
+    LineRegisters CaptureLineRegisters();
     void DrawScanline();
+    void RecordLineChange(bool palette_changed = false);
+    void WriteDMGPaletteRegister(std::array<u8, 4>& pal, u8 val);
 
     Hardware& m_hw;
 
-    std::array<u8, 0x4000> m_vram; // video RAM
-    std::array<u8, 0xA0> m_oam;    // object attribute memory
-
-    u8* m_vram_map;
-    int m_vram_bank;
-
-    // LCDC
-    bool m_bg_enable;
-    bool m_sprite_enable;
-    SpriteSize m_sprite_size;
-    BGTilemapSelect m_bg_tilemap_select;
-    PatternTableSelect m_pattern_table_select;
-    bool m_window_enable;
-    WindowTilemapSelect m_window_tilemap_select;
-    bool m_display_enable;
-
-    // STAT
-    DisplayMode m_display_mode;
-    bool m_coincidence_flag;
-    bool m_mode0_intr_enable;
-    bool m_mode1_intr_enable;
-    bool m_mode2_intr_enable;
-    bool m_coincidence_intr_enable;
-
-    u8 m_scy;
-    u8 m_scx;
-
-    u8 m_ly;
-    u8 m_lyc;
-
-    std::array<u8, 4> m_bgp;
-    std::array<std::array<u8, 4>, 2> m_obp;
-
-    u8 m_wy;
-    u8 m_wx;
-
-    u16 m_hdma_src;
-    u16 m_hdma_dest;
-    bool m_hdma_active;
-    int m_hdma_length;
-
-    bool m_bcp_auto_increment;
-    int m_bcp_index;
-    std::array<u8, 64> m_bcp;
-    bool m_ocp_auto_increment;
-    int m_ocp_index;
-    std::array<u8, 64> m_ocp;
-
-    u8* m_bg_tilemap;
-    u8* m_bg_attr_table;
-    u8* m_window_tilemap;
-    u8* m_window_attr_table;
-
-    u8 m_latched_wy;
-    u8 m_window_line;
-
-    int m_cycles_left;
-
-    std::array<FramebufferArray, 2> m_framebuffers;
-    int m_current_framebuffer;
-
-    std::array<int, lcd_width> m_bg_color_indices;
-    std::array<bool, lcd_width> m_bg_high_priority;
+    DirtyPageMap m_vram_dirty;
+    DirtyPageMap m_oam_dirty;
+
+    VideoMode m_video_mode;
+    bool m_frame_requested;
+    // Whether the frame in progress is being drawn, decided when it starts. VRAM and OAM writes
+    // are only passed to the renderer while it's set.
+    bool m_render_frame;
+    // Set when a write wasn't passed to the renderer, so its copy of VRAM and OAM is out of date.
+    bool m_renderer_memory_stale;
+    u64 m_rendered_frame_count;
+    u64 m_completed_frame_count;
+
+    PixelFormat m_pixel_format;
+    Renderer m_renderer;
+
+    // Converts palette RAM colors to host colors, which are sent to the renderer when the
+    // palettes are written.
+    std::shared_ptr<const ColorTable> m_color_table;
+
+    // Whether registers were written during the current line's pixel transfer, the registers the
+    // renderer is drawing it with so far, and the window line counter the line started with.
+    bool m_line_changed;
+    LineRegisters m_line_registers;
+    u8 m_line_window_line;
+    bool m_line_window_counted;
 };
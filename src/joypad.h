@@ -32,7 +32,16 @@ const unsigned int joyp_dpad_left = Bit(1);
 const unsigned int joyp_dpad_up = Bit(2);
 const unsigned int joyp_dpad_down = Bit(3);
 
-class Joypad
+// Mutable joypad state. Kept trivially copyable so it can be snapshotted with a plain copy.
+struct JoypadState
+{
+    bool m_dpad_keys_enable;
+    bool m_button_keys_enable;
+    u8 m_dpad_keys;
+    u8 m_button_keys;
+};
+
+class Joypad : private JoypadState
 {
 public:
     void Reset();
@@ -42,9 +51,13 @@ public:
 
     void SetKeyState(u8 dpad_keys, u8 button_keys);
 
-private:
-    bool m_dpad_keys_enable;
-    bool m_button_keys_enable;
-    u8 m_dpad_keys;
-    u8 m_button_keys;
+    void SaveState(JoypadState& state) const
+    {
+        state = *this;
+    }
+
+    void LoadState(const JoypadState& state)
+    {
+        static_cast<JoypadState&>(*this) = state;
+    }
 };
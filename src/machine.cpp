@@ -42,6 +42,28 @@ void Machine::Run(unsigned int cycles)
     m_hw.cpu.Run(cycles);
 }
 
+// Runs until the next VBlank, one scanline at a time. Returns false if the frame didn't complete
+// within a frame's worth of cycles, which happens while the LCD is off.
+bool Machine::RunFrame()
+{
+    const unsigned int frame_cycles = 17556 * 2;
+    const unsigned int scanline_cycles = 114 * 2;
+
+    u64 frame_count = m_hw.graphics.GetCompletedFrameCount();
+
+    for (unsigned int cycles = 0; cycles < frame_cycles; cycles += scanline_cycles)
+    {
+        Run(scanline_cycles);
+
+        if (m_hw.graphics.GetCompletedFrameCount() != frame_count)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void Machine::SetKeyState(u8 dpad_keys, u8 button_keys)
 {
     m_hw.joypad.SetKeyState(dpad_keys, button_keys);
@@ -51,3 +73,23 @@ void Machine::SetTraceLogEnabled(bool enabled)
 {
     m_hw.cpu.SetTraceLogEnabled(enabled);
 }
+
+void Machine::SaveState(MachineState& state)
+{
+    m_hw.cpu.SaveState(state.cpu);
+    m_hw.memory.SaveState(state.memory, state.mapper);
+    m_hw.timer.SaveState(state.timer);
+    m_hw.audio.SaveState(state.audio);
+    m_hw.graphics.SaveState(state.graphics);
+    m_hw.joypad.SaveState(state.joypad);
+}
+
+void Machine::LoadState(const MachineState& state)
+{
+    m_hw.cpu.LoadState(state.cpu);
+    m_hw.memory.LoadState(state.memory, state.mapper);
+    m_hw.timer.LoadState(state.timer);
+    m_hw.audio.LoadState(state.audio);
+    m_hw.graphics.LoadState(state.graphics);
+    m_hw.joypad.LoadState(state.joypad);
+}
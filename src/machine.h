@@ -21,8 +21,9 @@
 #pragma once
 
 #include <vector>
-#include <mutex>
+#include <type_traits>
 #include "common.h"
+#include "access_stats.h"
 #include "cpu.h"
 #include "memory.h"
 #include "timer.h"
@@ -49,42 +50,170 @@ struct Hardware
     Audio audio;
     Graphics graphics;
     Joypad joypad;
+#ifdef GBEMU_ACCESS_STATS
+    AccessStats access_stats;
+#endif
 };
 
+// Snapshot of all mutable machine state. It holds no pointers, so it can be copied with memcpy,
+// written to disk, or placed in shared memory. It is only valid for the ROM it was saved from.
+struct MachineState
+{
+    CPUState cpu;
+    MemoryState memory;
+    MapperState mapper;
+    TimerState timer;
+    AudioState audio;
+    GraphicsState graphics;
+    JoypadState joypad;
+};
+
+static_assert(std::is_trivially_copyable<MachineState>::value, "MachineState must be trivially copyable");
+
 class Machine
 {
 public:
     Machine(ROMInfo& rom_info);
     void Reset();
     void Run(unsigned int cycles);
+    bool RunFrame();
     void SetKeyState(u8 dpad_keys, u8 button_keys);
     void SetTraceLogEnabled(bool enabled);
+    void SaveState(MachineState& state);
+    void LoadState(const MachineState& state);
+
+    // Pages written since the last call to ClearDirtyPages() (or since the last reset or LoadState).
+    const DirtyPageMap& GetDirtyPages(MemoryRegion region)
+    {
+        return m_hw.memory.GetDirtyPages(region);
+    }
+
+    void ClearDirtyPages()
+    {
+        m_hw.memory.ClearDirtyPages();
+    }
+
+    // See Audio::ReadSamples().
+    size_t ReadAudioSamples(float* samples, size_t count)
+    {
+        return m_hw.audio.ReadSamples(samples, count);
+    }
+
+    size_t GetBufferedAudioSampleCount() const
+    {
+        return m_hw.audio.GetBufferedSampleCount();
+    }
+
+    // See Audio::SetSampleRate().
+    void SetAudioSampleRate(unsigned int rate)
+    {
+        m_hw.audio.SetSampleRate(rate);
+    }
+
+    unsigned int GetAudioSampleRate() const
+    {
+        return m_hw.audio.GetSampleRate();
+    }
+
+    // See Audio::SetRateControlTarget().
+    void SetAudioRateControlTarget(size_t buffered_samples)
+    {
+        m_hw.audio.SetRateControlTarget(buffered_samples);
+    }
+
+    size_t GetAudioRateControlTarget() const
+    {
+        return m_hw.audio.GetRateControlTarget();
+    }
+
+    // See Audio::SetRecorder(). Frames are submitted to the recorder by the caller.
+    void SetAudioRecorder(Recorder* recorder)
+    {
+        m_hw.audio.SetRecorder(recorder);
+    }
+
+    void SetPixelFormat(PixelFormat format)
+    {
+        m_hw.graphics.SetPixelFormat(format);
+    }
+
+    PixelFormat GetPixelFormat() const
+    {
+        return m_hw.graphics.GetPixelFormat();
+    }
 
-    const std::vector<float>& GetAudioSampleBuffer()
+    unsigned int GetFramebufferPitch() const
     {
-        return m_hw.audio.GetSampleBuffer();
+        return m_hw.graphics.GetFramebufferPitch();
     }
 
-    void ClearAudioSampleBuffer()
+    // See Graphics::SetRenderThreadEnabled().
+    void SetRenderThreadEnabled(bool enabled)
     {
-        m_hw.audio.ClearSampleBuffer();
+        m_hw.graphics.SetRenderThreadEnabled(enabled);
     }
 
-    void ConsumeAudioSampleBuffer(size_t num_samples)
+    void SyncRenderer()
     {
-        m_hw.audio.ConsumeSampleBuffer(num_samples);
+        m_hw.graphics.SyncRenderer();
     }
 
-    std::mutex& GetAudioSampleBufferMutex()
+    // See Graphics::AcquireFrame().
+    const Frame& AcquireFrame()
     {
-        return m_hw.audio.GetSampleBufferMutex();
+        return m_hw.graphics.AcquireFrame();
     }
 
-    const FramebufferArray& GetFramebuffer() const
+    const FramebufferArray& GetFramebuffer()
     {
         return m_hw.graphics.GetFramebuffer();
     }
 
+    // See Graphics::SetHostFramebuffer(). Use with RunFrame() so that a whole frame is drawn
+    // while the memory is available, followed by SyncRenderer() if the render thread is enabled.
+    void SetHostFramebuffer(void* pixels, unsigned int pitch)
+    {
+        m_hw.graphics.SetHostFramebuffer(pixels, pitch);
+    }
+
+    // See Graphics::SetObservationBuffer(). Use with RunFrame() like SetHostFramebuffer().
+    bool SetObservationBuffer(u8* buffer, unsigned int width, unsigned int height, ObservationFormat format)
+    {
+        return m_hw.graphics.SetObservationBuffer(buffer, width, height, format);
+    }
+
+    // See Graphics::SetTileGrid().
+    void SetTileGrid(TileGrid* grid)
+    {
+        m_hw.graphics.SetTileGrid(grid);
+    }
+
+    const FramebufferPalette& GetFramebufferPalette() const
+    {
+        return m_hw.graphics.GetFramebufferPalette();
+    }
+
+    void SetColorTable(std::shared_ptr<const ColorTable> table)
+    {
+        m_hw.graphics.SetColorTable(std::move(table));
+    }
+
+    void SetVideoMode(VideoMode mode)
+    {
+        m_hw.graphics.SetVideoMode(mode);
+    }
+
+    // In VideoMode::OnDemand, draws the next frame to start.
+    void RequestFrame()
+    {
+        m_hw.graphics.RequestFrame();
+    }
+
+    u64 GetRenderedFrameCount() const
+    {
+        return m_hw.graphics.GetRenderedFrameCount();
+    }
+
     const std::vector<u8>& GetRAM()
     {
         return m_hw.memory.GetRAM();
@@ -95,6 +224,13 @@ public:
         return m_hw.memory.GetRTCData();
     }
 
+#ifdef GBEMU_ACCESS_STATS
+    AccessStats& GetAccessStats()
+    {
+        return m_hw.access_stats;
+    }
+#endif
+
 private:
     Hardware m_hw;
 };
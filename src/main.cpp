@@ -23,14 +23,195 @@
 #include <string.h>
 #include <vector>
 #include <string>
-#include <mutex>
 #include <algorithm>
 #include "common.h"
 #include "machine.h"
+#include "post_process.h"
+#include "recorder.h"
 #include "SDL.h"
 
 const unsigned int num_audio_channels = 2;
-const unsigned int sdl_audio_buffer_size = 4096;
+const unsigned int sdl_audio_buffer_size = 1024;
+
+// Audio rate control aims to keep this many of the device's buffers waiting.
+const unsigned int audio_target_buffers = 2;
+
+const double frame_duration = (17556 * 2) / 2097152.0;
+
+const int min_fast_forward_multiplier = 2;
+const int max_fast_forward_multiplier = 8;
+const int default_fast_forward_multiplier = 4;
+
+// When fast-forwarding without a cap, frames are run for about this many seconds between presents,
+// leaving the rest of the display refresh interval for presenting.
+const double uncapped_batch_duration = 0.012;
+
+// The frameskip governor never skips more than this many frames in a row, so the screen keeps updating.
+const int max_consecutive_skipped_frames = 4;
+
+// If emulation falls further behind than this, the governor stops trying to catch up.
+const double max_frameskip_lag = 0.25;
+
+enum class FastForwardStyle
+{
+    Multiplier,
+    Uncapped,
+};
+
+struct SpeedControl
+{
+    bool fast_forward_held = false;
+    bool fast_forward_toggled = false;
+    FastForwardStyle style = FastForwardStyle::Multiplier;
+    int multiplier = default_fast_forward_multiplier;
+
+    bool IsFastForwarding() const
+    {
+        return fast_forward_held || fast_forward_toggled;
+    }
+};
+
+// CPU upscaling, which doesn't rely on the renderer scaling the texture. Off by default.
+struct PostProcessSettings
+{
+    bool enabled = false;
+    ScaleFilter filter = ScaleFilter::ScaleNx;
+    unsigned int scale = PostProcessor::max_scale;
+};
+
+const char* GetScaleFilterName(ScaleFilter filter)
+{
+    switch (filter)
+    {
+    case ScaleFilter::Nearest:
+        return "Nearest";
+    case ScaleFilter::ScaleNx:
+        return "Scale";
+    case ScaleFilter::Xbr:
+        return "xBR";
+    }
+
+    return "";
+}
+
+// Shows the post-processing filter and its measured cost per frame.
+void UpdateWindowTitle(SDL_Window* window, const PostProcessSettings& settings, PostProcessor& post_processor)
+{
+    if (!settings.enabled)
+    {
+        SDL_SetWindowTitle(window, "GB Emu");
+        return;
+    }
+
+    char title[64];
+    snprintf(title, sizeof(title), "GB Emu - %s %ux (%.2f ms)", GetScaleFilterName(settings.filter), settings.scale,
+        post_processor.GetAverageFrameTime() * 1000.0);
+    SDL_SetWindowTitle(window, title);
+}
+
+// The emulator writes frames in the texture's format, so they can be uploaded without conversion.
+const PixelFormat pixel_format = PixelFormat::XRGB8888;
+
+Uint32 GetSDLPixelFormat(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::XRGB8888:
+        return SDL_PIXELFORMAT_RGB888;
+    case PixelFormat::ABGR8888:
+        return SDL_PIXELFORMAT_ABGR8888;
+    case PixelFormat::RGB565:
+        return SDL_PIXELFORMAT_RGB565;
+    case PixelFormat::Indexed8:
+        // not supported for display
+        break;
+    }
+
+    return SDL_PIXELFORMAT_RGB888;
+}
+
+double GetSeconds()
+{
+    return static_cast<double>(SDL_GetPerformanceCounter()) / SDL_GetPerformanceFrequency();
+}
+
+// Skips rendering and presenting frames while emulation is behind wall-clock time.
+class FrameskipGovernor
+{
+public:
+    FrameskipGovernor()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        m_lag = 0.0;
+        m_last_time = GetSeconds();
+        m_consecutive_skipped_frames = 0;
+    }
+
+    bool ShouldRenderFrame() const
+    {
+        return m_lag < frame_duration || m_consecutive_skipped_frames >= max_consecutive_skipped_frames;
+    }
+
+    void EndFrame(bool rendered)
+    {
+        double now = GetSeconds();
+        m_lag += (now - m_last_time) - frame_duration;
+        m_last_time = now;
+
+        if (m_lag < 0.0 || m_lag > max_frameskip_lag)
+        {
+            m_lag = 0.0;
+        }
+
+        m_consecutive_skipped_frames = rendered ? 0 : m_consecutive_skipped_frames + 1;
+    }
+
+private:
+    double m_lag;
+    double m_last_time;
+    int m_consecutive_skipped_frames;
+};
+
+// Keeps emulation at the LCD refresh rate by sleeping until each frame is due. Audio follows by
+// rate control, so there's no need to wait on its buffer.
+class FramePacer
+{
+public:
+    FramePacer()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        m_next_frame_time = GetSeconds() + frame_duration;
+    }
+
+    void Wait()
+    {
+        double remaining = m_next_frame_time - GetSeconds();
+
+        if (remaining > 0.0)
+        {
+            SDL_Delay(static_cast<Uint32>(remaining * 1000));
+        }
+
+        m_next_frame_time += frame_duration;
+
+        // Rather than rushing to catch up after a long stall, start again from now.
+        if (-remaining > max_frameskip_lag)
+        {
+            Reset();
+        }
+    }
+
+private:
+    double m_next_frame_time;
+};
 
 void UpdateJoypad(Machine& machine)
 {
@@ -82,19 +263,134 @@ void UpdateJoypad(Machine& machine)
     machine.SetKeyState(dpad_keys, button_keys);
 }
 
-// Check if the emulator's audio buffer is more than 1.5 times as large as the SDL audio buffer.
-bool IsAudioBufferOverfilled(Machine& machine)
+// Fast-forwarding leaves far more audio buffered than rate control aims for, and draining it
+// that way would take many seconds. Sleeps once for as long as the excess takes to play
+// instead. Returns true if it slept.
+bool WaitForExcessAudio(Machine& machine)
+{
+    size_t target = machine.GetAudioRateControlTarget();
+    size_t buffered = machine.GetBufferedAudioSampleCount();
+
+    if (buffered <= 2 * target)
+    {
+        return false;
+    }
+
+    u64 excess_frames = (buffered - target) / num_audio_channels;
+    SDL_Delay(static_cast<Uint32>(excess_frames * 1000 / machine.GetAudioSampleRate()));
+    return true;
+}
+
+// Copies runs of changed lines (or every line) into the texture. Returns false if there was nothing to copy.
+bool UploadFrame(SDL_Texture* texture, const Frame& frame, unsigned int pitch, bool all_lines)
 {
-    std::lock_guard<std::mutex> lock(machine.GetAudioSampleBufferMutex());
+    const u8* pixels = reinterpret_cast<const u8*>(frame.pixels.data());
+    bool uploaded = false;
+    int y = 0;
+
+    while (y < lcd_height)
+    {
+        if (!all_lines && !frame.changed_lines[y])
+        {
+            y++;
+            continue;
+        }
+
+        int first_line = y;
+
+        while (y < lcd_height && (all_lines || frame.changed_lines[y]))
+        {
+            y++;
+        }
 
-    const std::vector<float>& audio_sample_buffer = machine.GetAudioSampleBuffer();
+        SDL_Rect rect = { 0, first_line, lcd_width, y - first_line };
+        SDL_UpdateTexture(texture, &rect, pixels + (first_line * pitch), pitch);
+        uploaded = true;
+    }
 
-    return audio_sample_buffer.size() > (150 * sdl_audio_buffer_size * num_audio_channels) / 100;
+    return uploaded;
 }
 
-void MainLoop(SDL_Renderer* renderer, SDL_Texture* texture, Machine& machine)
+// Runs several frames, only drawing the last. Returns the number of frames run.
+unsigned int RunFastForward(Machine& machine, const SpeedControl& speed)
+{
+    unsigned int frames_run = 1;
+
+    if (speed.style == FastForwardStyle::Multiplier)
+    {
+        for (int i = 1; i < speed.multiplier; i++)
+        {
+            machine.RunFrame();
+            frames_run++;
+        }
+    }
+    else
+    {
+        double start = GetSeconds();
+
+        while (GetSeconds() - start < uncapped_batch_duration)
+        {
+            machine.RunFrame();
+            frames_run++;
+        }
+    }
+
+    machine.RequestFrame();
+    machine.RunFrame();
+    return frames_run;
+}
+
+void StartRecording(Machine& machine, Recorder& recorder)
+{
+    if (!recorder.Start("recording.y4m", "recording.wav", machine.GetAudioSampleRate()))
+    {
+        fprintf(stderr, "Unable to start recording\n");
+        return;
+    }
+
+    machine.SetAudioRecorder(&recorder);
+    printf("Recording started\n");
+}
+
+void StopRecording(Machine& machine, Recorder& recorder)
+{
+    if (!recorder.IsRecording())
+    {
+        return;
+    }
+
+    machine.SetAudioRecorder(nullptr);
+
+    if (!recorder.Stop())
+    {
+        fprintf(stderr, "Unable to write recording\n");
+    }
+
+    RecorderStats stats = recorder.GetStats();
+    printf("Recording stopped: %llu frames (%llu duplicates), %llu frames and %llu samples dropped\n",
+        (unsigned long long)stats.frames_written, (unsigned long long)stats.duplicate_frames,
+        (unsigned long long)stats.dropped_frames, (unsigned long long)stats.dropped_samples);
+}
+
+void MainLoop(SDL_Window* window, SDL_Renderer* renderer, SDL_Texture* texture, SDL_Texture* scaled_texture, Machine& machine)
 {
     bool paused = false;
+    SpeedControl speed;
+    FrameskipGovernor governor;
+    FramePacer pacer;
+    bool texture_valid = false;
+    u64 texture_sequence = 0;
+
+    PostProcessor post_processor;
+    PostProcessSettings post_process;
+    bool post_process_changed = true;
+    u64 submitted_sequence = 0;
+    SDL_Rect scaled_rect = { 0, 0, 0, 0 };
+    double last_title_update = 0.0;
+
+    Recorder recorder;
+
+    machine.SetVideoMode(VideoMode::OnDemand);
 
     for (;;)
     {
@@ -105,6 +401,7 @@ void MainLoop(SDL_Renderer* renderer, SDL_Texture* texture, Machine& machine)
             switch (event.type)
             {
             case SDL_QUIT:
+                StopRecording(machine, recorder);
                 return;
             case SDL_KEYDOWN:
                 switch (event.key.keysym.sym)
@@ -112,30 +409,197 @@ void MainLoop(SDL_Renderer* renderer, SDL_Texture* texture, Machine& machine)
                 case SDLK_p:
                     paused = !paused;
                     break;
+                case SDLK_TAB:
+                    speed.fast_forward_held = true;
+                    break;
+                case SDLK_f:
+                    speed.fast_forward_toggled = !speed.fast_forward_toggled;
+                    break;
+                case SDLK_u:
+                    speed.style = (speed.style == FastForwardStyle::Uncapped) ? FastForwardStyle::Multiplier : FastForwardStyle::Uncapped;
+                    break;
+                case SDLK_MINUS:
+                    speed.multiplier = std::max(speed.multiplier - 1, min_fast_forward_multiplier);
+                    break;
+                case SDLK_EQUALS:
+                    speed.multiplier = std::min(speed.multiplier + 1, max_fast_forward_multiplier);
+                    break;
+                case SDLK_F1:
+                    post_process.enabled = false;
+                    post_process_changed = true;
+                    break;
+                case SDLK_F2:
+                    post_process.enabled = true;
+                    post_process.filter = ScaleFilter::Nearest;
+                    post_process_changed = true;
+                    break;
+                case SDLK_F3:
+                    post_process.enabled = true;
+                    post_process.filter = ScaleFilter::ScaleNx;
+                    post_process_changed = true;
+                    break;
+                case SDLK_F4:
+                    post_process.scale = (post_process.scale % PostProcessor::max_scale) + 1;
+                    post_process.scale = std::max(post_process.scale, 2u);
+                    post_process_changed = true;
+                    break;
+                case SDLK_F5:
+                    post_process.enabled = true;
+                    post_process.filter = ScaleFilter::Xbr;
+                    post_process_changed = true;
+                    break;
+                case SDLK_r:
+                    if (recorder.IsRecording())
+                    {
+                        StopRecording(machine, recorder);
+                    }
+                    else
+                    {
+                        StartRecording(machine, recorder);
+                    }
+                    break;
                 case SDLK_t:
                     machine.SetTraceLogEnabled(true);
                     break;
                 case SDLK_y:
                     machine.SetTraceLogEnabled(false);
                     break;
+#ifdef GBEMU_ACCESS_STATS
+                case SDLK_m:
+                    if (!machine.GetAccessStats().WriteCSV("access_stats.csv")
+                        || !machine.GetAccessStats().WriteJSON("access_stats.json"))
+                    {
+                        fprintf(stderr, "Unable to write access statistics\n");
+                    }
+                    machine.GetAccessStats().ClearHistory();
+                    break;
+#endif
                 }
+                break;
+            case SDL_KEYUP:
+                if (event.key.keysym.sym == SDLK_TAB)
+                {
+                    speed.fast_forward_held = false;
+                }
+                break;
             }
         }
 
         UpdateJoypad(machine);
 
+        unsigned int frames_run = 0;
+
         if (!paused)
         {
-            machine.Run(17556 * 2);
+            if (speed.IsFastForwarding())
+            {
+                // Audio is produced faster than it's played, and what doesn't fit in the
+                // emulator's buffer is dropped.
+                frames_run = RunFastForward(machine, speed);
+                governor.Reset();
+            }
+            else
+            {
+                bool render = governor.ShouldRenderFrame();
+
+                if (render)
+                {
+                    machine.RequestFrame();
+                }
+
+                machine.RunFrame();
+                frames_run = 1;
+
+                governor.EndFrame(render);
+            }
+        }
+
+        // Only lines that changed are uploaded. Frames that weren't drawn, or that are identical to
+        // the one in the texture, aren't presented, which also skips waiting for vsync. The render
+        // thread usually finishes a frame while the next one is being emulated, so this is often
+        // the frame before the one just run.
+        const Frame& frame = machine.AcquireFrame();
+        bool present = paused;
+
+        // The frame stands in for every frame just run, which keeps the video in step with the
+        // audio even when frames are skipped.
+        recorder.SubmitFrame(frame, machine.GetPixelFormat(), frames_run);
+
+        if (post_process_changed)
+        {
+            post_processor.SetScaling(post_process.filter, post_process.scale);
+            UpdateWindowTitle(window, post_process, post_processor);
+            texture_valid = false;
+            scaled_rect.w = 0;
+        }
+
+        if (post_process.enabled)
+        {
+            // Frames are scaled on the post-processing thread and presented once they're ready,
+            // usually on the next pass through the loop.
+            if (post_process_changed || frame.sequence != submitted_sequence)
+            {
+                post_processor.Submit(frame);
+                submitted_sequence = frame.sequence;
+            }
+
+            if (post_processor.Acquire())
+            {
+                const ScaledFrame& scaled = post_processor.GetFrame();
+                scaled_rect = { 0, 0, static_cast<int>(scaled.width), static_cast<int>(scaled.height) };
+                SDL_UpdateTexture(scaled_texture, &scaled_rect, scaled.pixels.data(), scaled.width * sizeof(u32));
+                present = true;
+            }
+
+            if (GetSeconds() - last_title_update >= 1.0)
+            {
+                UpdateWindowTitle(window, post_process, post_processor);
+                last_title_update = GetSeconds();
+            }
+        }
+        else if (!texture_valid || frame.sequence != texture_sequence)
+        {
+            bool all_lines = !texture_valid || frame.sequence != texture_sequence + 1;
+            present |= UploadFrame(texture, frame, machine.GetFramebufferPitch(), all_lines);
+            texture_valid = true;
+            texture_sequence = frame.sequence;
         }
 
-        SDL_UpdateTexture(texture, NULL, machine.GetFramebuffer().data(), lcd_width * sizeof(Uint32));
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
+        post_process_changed = false;
 
-        while (IsAudioBufferOverfilled(machine))
+        // Until the first scaled frame arrives, there's nothing to show.
+        if (post_process.enabled && scaled_rect.w == 0)
         {
-            SDL_Delay(1);
+            present = false;
+        }
+
+        if (present)
+        {
+            if (post_process.enabled)
+            {
+                SDL_RenderCopy(renderer, scaled_texture, &scaled_rect, NULL);
+            }
+            else
+            {
+                SDL_RenderCopy(renderer, texture, NULL, NULL);
+            }
+
+            SDL_RenderPresent(renderer);
+        }
+
+        if (speed.IsFastForwarding())
+        {
+            pacer.Reset();
+        }
+        else if (WaitForExcessAudio(machine))
+        {
+            // Waiting for audio means emulation is ahead of real time, so nothing needs to be skipped.
+            pacer.Reset();
+            governor.Reset();
+        }
+        else
+        {
+            pacer.Wait();
         }
     }
 }
@@ -144,16 +608,9 @@ void AudioCallback(void* userdata, Uint8* stream, int len)
 {
     Machine* machine = static_cast<Machine*>(userdata);
 
-    std::lock_guard<std::mutex> lock(machine->GetAudioSampleBufferMutex());
+    size_t read_len = machine->ReadAudioSamples(reinterpret_cast<float*>(stream), len / sizeof(float)) * sizeof(float);
 
-    const std::vector<float>& audio_sample_buffer = machine->GetAudioSampleBuffer();
-
-    size_t available_len = std::min(static_cast<size_t>(len), audio_sample_buffer.size() * sizeof(float));
-
-    memcpy(stream, audio_sample_buffer.data(), available_len);
-    memset(stream + available_len, 0, len - available_len);
-
-    machine->ConsumeAudioSampleBuffer(available_len / sizeof(float));
+    memset(stream + read_len, 0, len - read_len);
 }
 
 int main(int argc, char** argv)
@@ -210,6 +667,8 @@ int main(int argc, char** argv)
     }
 
     Machine machine(rom_info);
+    machine.SetPixelFormat(pixel_format);
+    machine.SetRenderThreadEnabled(true);
 
     const int screen_scale = 2;
     const int screen_width = lcd_width * screen_scale;
@@ -244,7 +703,7 @@ int main(int argc, char** argv)
         fprintf(stderr, "Unable to set logical size for rendering: %s\n", SDL_GetError());
     }
 
-    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, lcd_width, lcd_height);
+    SDL_Texture* texture = SDL_CreateTexture(renderer, GetSDLPixelFormat(pixel_format), SDL_TEXTUREACCESS_STREAMING, lcd_width, lcd_height);
 
     if (texture == nullptr)
     {
@@ -252,16 +711,27 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // Upscaled frames are uploaded to the top-left corner of this texture.
+    SDL_Texture* scaled_texture = SDL_CreateTexture(renderer, GetSDLPixelFormat(pixel_format), SDL_TEXTUREACCESS_STREAMING,
+        lcd_width * PostProcessor::max_scale, lcd_height * PostProcessor::max_scale);
+
+    if (scaled_texture == nullptr)
+    {
+        fprintf(stderr, "Unable to create texture: %s\n", SDL_GetError());
+        return 1;
+    }
+
     SDL_AudioSpec desired_spec, obtained_spec;
     SDL_memset(&desired_spec, 0, sizeof(desired_spec));
-    desired_spec.freq = sample_rate;
+    desired_spec.freq = default_sample_rate;
     desired_spec.format = AUDIO_F32;
     desired_spec.channels = num_audio_channels;
     desired_spec.samples = sdl_audio_buffer_size;
     desired_spec.callback = AudioCallback;
     desired_spec.userdata = &machine;
 
-    SDL_AudioDeviceID audio_dev = SDL_OpenAudioDevice(nullptr, 0, &desired_spec, &obtained_spec, 0);
+    // Samples are made at the device's own rate, which saves SDL converting them.
+    SDL_AudioDeviceID audio_dev = SDL_OpenAudioDevice(nullptr, 0, &desired_spec, &obtained_spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
 
     if (audio_dev == 0)
     {
@@ -269,9 +739,15 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    machine.SetAudioSampleRate(obtained_spec.freq);
+
+    // The target leaves room below the ring's capacity for the bursts the device takes.
+    size_t audio_target = std::min<size_t>(audio_target_buffers * obtained_spec.samples * num_audio_channels, max_buffered_samples / 2);
+    machine.SetAudioRateControlTarget(audio_target);
+
     SDL_PauseAudioDevice(audio_dev, 0);
 
-    MainLoop(renderer, texture, machine);
+    MainLoop(window, renderer, texture, scaled_texture, machine);
 
     if (rom_info.has_battery)
     {
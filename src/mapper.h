@@ -20,8 +20,39 @@
 
 #pragma once
 
+#include <string.h>
+#include <array>
+#include <type_traits>
 #include <vector>
 #include "common.h"
+#include "dirty_page_map.h"
+
+const size_t max_cart_ram_size = 0x20000;
+const size_t max_mapper_regs_size = 64;
+
+// Snapshot of a mapper's mutable state. The layout of regs is specific to each mapper.
+struct MapperState
+{
+    std::array<u8, max_mapper_regs_size> regs;
+    std::array<u8, max_cart_ram_size> ram;
+};
+
+template <typename T>
+void SaveMapperState(MapperState& state, const T& regs, const std::vector<u8>& ram)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "mapper registers must be trivially copyable");
+    static_assert(sizeof(T) <= max_mapper_regs_size, "mapper registers don't fit in MapperState");
+
+    memcpy(state.regs.data(), &regs, sizeof(T));
+    memcpy(state.ram.data(), ram.data(), ram.size());
+}
+
+template <typename T>
+void LoadMapperState(const MapperState& state, T& regs, std::vector<u8>& ram)
+{
+    memcpy(&regs, state.regs.data(), sizeof(T));
+    memcpy(ram.data(), state.ram.data(), ram.size());
+}
 
 class Mapper
 {
@@ -31,9 +62,30 @@ public:
     virtual u8 Read(u16 addr) = 0;
     virtual void Write(u16 addr, u8 val) = 0;
     virtual const std::vector<u8>& GetRAM() = 0;
+    virtual void SaveState(MapperState& state) const = 0;
+    virtual void LoadState(const MapperState& state) = 0;
+
+    // Banks currently mapped at 4000-7FFF and A000-BFFF.
+    virtual unsigned int GetROMBank()
+    {
+        return 1;
+    }
+
+    virtual unsigned int GetRAMBank()
+    {
+        return 0;
+    }
 
     virtual std::vector<u8> GetRTCData()
     {
         return std::vector<u8>();
     }
+
+    DirtyPageMap& GetRAMDirtyPages()
+    {
+        return m_ram_dirty;
+    }
+
+protected:
+    DirtyPageMap m_ram_dirty;
 };
@@ -24,12 +24,13 @@ MBC1::MBC1(ROMInfo& rom_info) :
     m_rom(std::move(*rom_info.rom)),
     m_ram(std::move(*rom_info.ram))
 {
+    m_ram_dirty.SetRegionSize(m_ram.size());
 }
 
 void MBC1::Reset()
 {
-    m_rom_map = nullptr;
-    m_ram_map = nullptr;
+    m_rom_map_offset = 0;
+    m_ram_map_offset = 0;
     m_bank_reg1 = 1;
     m_bank_reg2 = 0;
     m_ram_enable = false;
@@ -45,11 +46,11 @@ u8 MBC1::Read(u16 addr)
     }
     else if (addr < 0x8000)
     {
-        return m_rom_map[addr - 0x4000];
+        return m_rom[m_rom_map_offset + (addr - 0x4000)];
     }
     else if (addr >= 0xA000 && addr < 0xC000 && m_ram.size() != 0 && m_ram_enable)
     {
-        return m_ram_map[(addr - 0xA000) & (m_ram.size() - 1)];
+        return m_ram[m_ram_map_offset + ((addr - 0xA000) & (m_ram.size() - 1))];
     }
 
     return 0;
@@ -83,11 +84,13 @@ void MBC1::Write(u16 addr, u8 val)
     }
     else if (addr >= 0xA000 && addr < 0xC000 && m_ram.size() != 0 && m_ram_enable)
     {
-        m_ram_map[(addr - 0xA000) & (m_ram.size() - 1)] = val;
+        u32 offset = m_ram_map_offset + ((addr - 0xA000) & (m_ram.size() - 1));
+        m_ram[offset] = val;
+        m_ram_dirty.Mark(offset);
     }
 }
 
-int MBC1::GetROMBank()
+unsigned int MBC1::GetROMBank()
 {
     if (m_ram_banking_mode)
     {
@@ -99,7 +102,7 @@ int MBC1::GetROMBank()
     }
 }
 
-int MBC1::GetRAMBank()
+unsigned int MBC1::GetRAMBank()
 {
     if (m_ram_banking_mode)
     {
@@ -113,12 +116,22 @@ int MBC1::GetRAMBank()
 
 void MBC1::UpdateMapping()
 {
-    u32 rom_addr = (GetROMBank() * 0x4000) & (m_rom.size() - 1);
-    m_rom_map = &m_rom[rom_addr];
+    m_rom_map_offset = (GetROMBank() * 0x4000) & (m_rom.size() - 1);
 
     if (m_ram.size() != 0)
     {
-        u32 ram_addr = (GetRAMBank() * 0x2000) & (m_ram.size() - 1);
-        m_ram_map = &m_ram[ram_addr];
+        m_ram_map_offset = (GetRAMBank() * 0x2000) & (m_ram.size() - 1);
     }
 }
+
+void MBC1::SaveState(MapperState& state) const
+{
+    SaveMapperState(state, static_cast<const MBC1State&>(*this), m_ram);
+}
+
+void MBC1::LoadState(const MapperState& state)
+{
+    LoadMapperState(state, static_cast<MBC1State&>(*this), m_ram);
+    UpdateMapping();
+    m_ram_dirty.MarkAll();
+}
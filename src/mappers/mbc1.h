@@ -25,7 +25,18 @@
 #include "../mapper.h"
 #include "../rom.h"
 
-class MBC1 : public Mapper
+// Mutable MBC1 registers. Banks are stored as offsets into m_rom and m_ram.
+struct MBC1State
+{
+    u32 m_rom_map_offset;
+    u32 m_ram_map_offset;
+    unsigned int m_bank_reg1;
+    unsigned int m_bank_reg2;
+    bool m_ram_enable;
+    bool m_ram_banking_mode;
+};
+
+class MBC1 : public Mapper, private MBC1State
 {
 public:
     explicit MBC1(ROMInfo& rom_info);
@@ -38,17 +49,14 @@ public:
         return m_ram;
     }
 
+    virtual unsigned int GetROMBank() override;
+    virtual unsigned int GetRAMBank() override;
+    virtual void SaveState(MapperState& state) const override;
+    virtual void LoadState(const MapperState& state) override;
+
 private:
-    int GetROMBank();
-    int GetRAMBank();
     void UpdateMapping();
 
     std::vector<u8> m_rom;
     std::vector<u8> m_ram;
-    u8* m_rom_map;
-    u8* m_ram_map;
-    unsigned int m_bank_reg1;
-    unsigned int m_bank_reg2;
-    bool m_ram_enable;
-    bool m_ram_banking_mode;
 };
@@ -114,6 +114,8 @@ MBC3::MBC3(ROMInfo& rom_info) :
     m_ram(std::move(*rom_info.ram)),
     m_has_rtc(rom_info.has_rtc)
 {
+    m_ram_dirty.SetRegionSize(m_ram.size());
+
     if (rom_info.has_rtc)
     {
         if (rom_info.loaded_rtc_data)
@@ -164,8 +166,8 @@ MBC3::MBC3(ROMInfo& rom_info) :
 
 void MBC3::Reset()
 {
-    m_rom_map = nullptr;
-    m_ram_map = nullptr;
+    m_rom_map_offset = 0;
+    m_ram_map_offset = 0;
     m_rom_bank = 1;
     m_ram_bank = 0;
     m_ram_enable = false;
@@ -183,7 +185,7 @@ u8 MBC3::Read(u16 addr)
     }
     else if (addr < 0x8000)
     {
-        return m_rom_map[addr - 0x4000];
+        return m_rom[m_rom_map_offset + (addr - 0x4000)];
     }
     else if (addr >= 0xA000 && addr < 0xC000 && m_ram_enable)
     {
@@ -192,7 +194,7 @@ u8 MBC3::Read(u16 addr)
         case RTC_REG_NONE:
             if (m_ram.size() != 0)
             {
-                return m_ram_map[(addr - 0xA000) & (m_ram.size() - 1)];
+                return m_ram[m_ram_map_offset + ((addr - 0xA000) & (m_ram.size() - 1))];
             }
             return 0;
         case RTC_REG_S:
@@ -285,7 +287,9 @@ void MBC3::Write(u16 addr, u8 val)
         {
             if (m_ram.size() != 0)
             {
-                m_ram_map[(addr - 0xA000) & (m_ram.size() - 1)] = val;
+                u32 offset = m_ram_map_offset + ((addr - 0xA000) & (m_ram.size() - 1));
+                m_ram[offset] = val;
+                m_ram_dirty.Mark(offset);
             }
         }
         else
@@ -353,16 +357,26 @@ std::vector<u8> MBC3::GetRTCData()
 
 void MBC3::UpdateMapping()
 {
-    u32 rom_addr = (m_rom_bank * 0x4000) & (m_rom.size() - 1);
-    m_rom_map = &m_rom[rom_addr];
+    m_rom_map_offset = (m_rom_bank * 0x4000) & (m_rom.size() - 1);
 
     if (m_ram.size() != 0)
     {
-        u32 ram_addr = (m_ram_bank * 0x2000) & (m_ram.size() - 1);
-        m_ram_map = &m_ram[ram_addr];
+        m_ram_map_offset = (m_ram_bank * 0x2000) & (m_ram.size() - 1);
     }
 }
 
+void MBC3::SaveState(MapperState& state) const
+{
+    SaveMapperState(state, static_cast<const MBC3State&>(*this), m_ram);
+}
+
+void MBC3::LoadState(const MapperState& state)
+{
+    LoadMapperState(state, static_cast<MBC3State&>(*this), m_ram);
+    UpdateMapping();
+    m_ram_dirty.MarkAll();
+}
+
 void MBC3::UpdateRTC()
 {
     const s64 seconds_per_day = 24 * 60 * 60;
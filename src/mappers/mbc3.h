@@ -25,22 +25,9 @@
 #include "../mapper.h"
 #include "../rom.h"
 
-class MBC3 : public Mapper
+// Mutable MBC3 registers. Banks are stored as offsets into m_rom and m_ram.
+struct MBC3State
 {
-public:
-    explicit MBC3(ROMInfo& rom_info);
-    virtual void Reset() override;
-    virtual u8 Read(u16 addr) override;
-    virtual void Write(u16 addr, u8 val) override;
-
-    virtual const std::vector<u8>& GetRAM() override
-    {
-        return m_ram;
-    }
-
-    virtual std::vector<u8> GetRTCData() override;
-
-private:
     enum RTCReg
     {
         RTC_REG_NONE = 0,
@@ -51,15 +38,8 @@ private:
         RTC_REG_DH = 12,
     };
 
-    void UpdateMapping();
-    void UpdateRTC();
-    void ResetRTCData();
-
-    std::vector<u8> m_rom;
-    std::vector<u8> m_ram;
-    const bool m_has_rtc;
-    u8* m_rom_map;
-    u8* m_ram_map;
+    u32 m_rom_map_offset;
+    u32 m_ram_map_offset;
     unsigned int m_rom_bank;
     unsigned int m_ram_bank;
     bool m_ram_enable;
@@ -78,3 +58,40 @@ private:
     u8 m_rtc_latched_dh;
     s64 m_rtc_last_update;
 };
+
+class MBC3 : public Mapper, private MBC3State
+{
+public:
+    explicit MBC3(ROMInfo& rom_info);
+    virtual void Reset() override;
+    virtual u8 Read(u16 addr) override;
+    virtual void Write(u16 addr, u8 val) override;
+
+    virtual const std::vector<u8>& GetRAM() override
+    {
+        return m_ram;
+    }
+
+    virtual unsigned int GetROMBank() override
+    {
+        return m_rom_bank;
+    }
+
+    virtual unsigned int GetRAMBank() override
+    {
+        return m_ram_bank;
+    }
+
+    virtual std::vector<u8> GetRTCData() override;
+    virtual void SaveState(MapperState& state) const override;
+    virtual void LoadState(const MapperState& state) override;
+
+private:
+    void UpdateMapping();
+    void UpdateRTC();
+    void ResetRTCData();
+
+    std::vector<u8> m_rom;
+    std::vector<u8> m_ram;
+    const bool m_has_rtc;
+};
@@ -25,7 +25,17 @@
 #include "../mapper.h"
 #include "../rom.h"
 
-class MBC5 : public Mapper
+// Mutable MBC5 registers. Banks are stored as offsets into m_rom and m_ram.
+struct MBC5State
+{
+    u32 m_rom_map_offset;
+    u32 m_ram_map_offset;
+    unsigned int m_rom_bank;
+    unsigned int m_ram_bank;
+    bool m_ram_enable;
+};
+
+class MBC5 : public Mapper, private MBC5State
 {
 public:
     explicit MBC5(ROMInfo& rom_info);
@@ -38,14 +48,22 @@ public:
         return m_ram;
     }
 
+    virtual unsigned int GetROMBank() override
+    {
+        return m_rom_bank;
+    }
+
+    virtual unsigned int GetRAMBank() override
+    {
+        return m_ram_bank;
+    }
+
+    virtual void SaveState(MapperState& state) const override;
+    virtual void LoadState(const MapperState& state) override;
+
 private:
     void UpdateMapping();
 
     std::vector<u8> m_rom;
     std::vector<u8> m_ram;
-    u8* m_rom_map;
-    u8* m_ram_map;
-    unsigned int m_rom_bank;
-    unsigned int m_ram_bank;
-    bool m_ram_enable;
 };
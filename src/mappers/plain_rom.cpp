@@ -24,6 +24,7 @@ PlainROM::PlainROM(ROMInfo& rom_info) :
     m_rom(std::move(*rom_info.rom)),
     m_ram(std::move(*rom_info.ram))
 {
+    m_ram_dirty.SetRegionSize(m_ram.size());
 }
 
 void PlainROM::Reset()
@@ -48,6 +49,19 @@ void PlainROM::Write(u16 addr, u8 val)
 {
     if (addr >= 0xA000 && addr < 0xC000 && m_ram.size() != 0)
     {
-        m_ram[(addr - 0xA000) & (m_ram.size() - 1)] = val;
+        u32 offset = (addr - 0xA000) & (m_ram.size() - 1);
+        m_ram[offset] = val;
+        m_ram_dirty.Mark(offset);
     }
 }
+
+void PlainROM::SaveState(MapperState& state) const
+{
+    memcpy(state.ram.data(), m_ram.data(), m_ram.size());
+}
+
+void PlainROM::LoadState(const MapperState& state)
+{
+    memcpy(m_ram.data(), state.ram.data(), m_ram.size());
+    m_ram_dirty.MarkAll();
+}
@@ -38,6 +38,9 @@ public:
         return m_ram;
     }
 
+    virtual void SaveState(MapperState& state) const override;
+    virtual void LoadState(const MapperState& state) override;
+
 private:
     std::vector<u8> m_rom;
     std::vector<u8> m_ram;
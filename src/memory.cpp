@@ -112,9 +112,53 @@ void Memory::Reset()
 {
     m_wram = {};
     m_hram = {};
-    m_wram_map = &m_wram[0x1000];
+    m_wram_map_offset = 0x1000;
     m_wram_bank = 0;
     m_mapper->Reset();
+    m_wram_dirty.MarkAll();
+    m_hram_dirty.MarkAll();
+}
+
+void Memory::SaveState(MemoryState& memory_state, MapperState& mapper_state) const
+{
+    memory_state = *this;
+    m_mapper->SaveState(mapper_state);
+}
+
+void Memory::LoadState(const MemoryState& memory_state, const MapperState& mapper_state)
+{
+    static_cast<MemoryState&>(*this) = memory_state;
+    WriteSVBK(m_wram_bank);
+    m_mapper->LoadState(mapper_state);
+    m_wram_dirty.MarkAll();
+    m_hram_dirty.MarkAll();
+}
+
+const DirtyPageMap& Memory::GetDirtyPages(MemoryRegion region)
+{
+    switch (region)
+    {
+    case MemoryRegion::WRAM:
+        return m_wram_dirty;
+    case MemoryRegion::VRAM:
+        return m_hw.graphics.GetVRAMDirtyPages();
+    case MemoryRegion::OAM:
+        return m_hw.graphics.GetOAMDirtyPages();
+    case MemoryRegion::HRAM:
+        return m_hram_dirty;
+    case MemoryRegion::CartRAM:
+        return m_mapper->GetRAMDirtyPages();
+    }
+
+    return m_wram_dirty; // unreachable
+}
+
+void Memory::ClearDirtyPages()
+{
+    m_wram_dirty.Clear();
+    m_hram_dirty.Clear();
+    m_hw.graphics.ClearDirtyPages();
+    m_mapper->GetRAMDirtyPages().Clear();
 }
 
 u8 Memory::ReadSVBK()
@@ -126,11 +170,13 @@ void Memory::WriteSVBK(u8 val)
 {
     m_wram_bank = val & svbk_mask;
     int bank = (m_wram_bank == 0) ? 1 : m_wram_bank;
-    m_wram_map = &m_wram[bank * 0x1000];
+    m_wram_map_offset = bank * 0x1000;
 }
 
 u8 Memory::ReadMMIO(u16 addr)
 {
+    COUNT_ACCESS(m_hw, CountMMIORead(addr));
+
     switch (addr)
     {
     case mmio_addr_joyp:
@@ -259,11 +305,13 @@ u8 Memory::Read_Fnnn(u16 addr)
     if (addr == mmio_addr_ie)
     {
         // 0xFFFF
+        COUNT_ACCESS(m_hw, CountIERead());
         return m_hw.cpu.ReadIE();
     }
     else if (addr >= 0xFF80)
     {
         // 0xFF80-0xFFFE
+        COUNT_ACCESS(m_hw, CountHRAMRead());
         return m_hram[addr - 0xFF80];
     }
     else if (addr >= 0xFF00)
@@ -280,11 +328,13 @@ u8 Memory::Read_Fnnn(u16 addr)
     else if (addr >= 0xFE00)
     {
         // 0xFE00-0xFE9F
+        COUNT_ACCESS(m_hw, CountOAMRead());
         return m_hw.graphics.ReadOAM(addr - 0xFE00);
     }
     else
     {
         // 0xF000-0xFDFF
+        COUNT_ACCESS(m_hw, CountWRAMRead(1));
         return m_wram[addr & 0x1FFF];
     }
 }
@@ -297,22 +347,30 @@ u8 Memory::Read(u16 addr)
     case 0x1:
     case 0x2:
     case 0x3:
+        COUNT_ACCESS(m_hw, CountROMRead(0));
+        return m_mapper->Read(addr);
     case 0x4:
     case 0x5:
     case 0x6:
     case 0x7:
+        COUNT_ACCESS(m_hw, CountROMRead(m_mapper->GetROMBank()));
         return m_mapper->Read(addr);
     case 0x8:
     case 0x9:
+        COUNT_ACCESS(m_hw, CountVRAMRead(m_hw.graphics.ReadVBK()));
         return m_hw.graphics.ReadVRAM(addr & 0x1FFF);
     case 0xA:
     case 0xB:
+        COUNT_ACCESS(m_hw, CountSRAMRead(m_mapper->GetRAMBank()));
         return m_mapper->Read(addr);
     case 0xC:
+        COUNT_ACCESS(m_hw, CountWRAMRead(0));
         return m_wram[addr & 0xFFF];
     case 0xD:
-        return m_wram_map[addr & 0xFFF];
+        COUNT_ACCESS(m_hw, CountWRAMRead((m_wram_bank == 0) ? 1 : m_wram_bank));
+        return m_wram[m_wram_map_offset + (addr & 0xFFF)];
     case 0xE:
+        COUNT_ACCESS(m_hw, CountWRAMRead(0));
         return m_wram[addr & 0xFFF];
     case 0xF:
         return Read_Fnnn(addr);
@@ -323,6 +381,8 @@ u8 Memory::Read(u16 addr)
 
 void Memory::WriteMMIO(u16 addr, u8 val)
 {
+    COUNT_ACCESS(m_hw, CountMMIOWrite(addr));
+
     switch (addr)
     {
     case mmio_addr_joyp:
@@ -508,12 +568,15 @@ void Memory::Write_Fnnn(u16 addr, u8 val)
     if (addr == mmio_addr_ie)
     {
         // 0xFFFF
+        COUNT_ACCESS(m_hw, CountIEWrite());
         m_hw.cpu.WriteIE(val);
     }
     else if (addr >= 0xFF80)
     {
         // 0xFF80-0xFFFE
+        COUNT_ACCESS(m_hw, CountHRAMWrite());
         m_hram[addr - 0xFF80] = val;
+        m_hram_dirty.Mark(addr - 0xFF80);
     }
     else if (addr >= 0xFF00)
     {
@@ -528,12 +591,15 @@ void Memory::Write_Fnnn(u16 addr, u8 val)
     else if (addr >= 0xFE00)
     {
         // 0xFE00-0xFE9F
+        COUNT_ACCESS(m_hw, CountOAMWrite());
         m_hw.graphics.WriteOAM(addr - 0xFE00, val);
     }
     else
     {
         // 0xF000-0xFDFF
+        COUNT_ACCESS(m_hw, CountWRAMWrite(1));
         m_wram[addr & 0x1FFF] = val;
+        m_wram_dirty.Mark(addr & 0x1FFF);
     }
 }
 
@@ -549,24 +615,33 @@ void Memory::Write(u16 addr, u8 val)
     case 0x5:
     case 0x6:
     case 0x7:
+        COUNT_ACCESS(m_hw, CountMapperWrite(addr));
         m_mapper->Write(addr, val);
         break;
     case 0x8:
     case 0x9:
+        COUNT_ACCESS(m_hw, CountVRAMWrite(m_hw.graphics.ReadVBK()));
         m_hw.graphics.WriteVRAM(addr & 0x1FFF, val);
         break;
     case 0xA:
     case 0xB:
+        COUNT_ACCESS(m_hw, CountSRAMWrite(m_mapper->GetRAMBank()));
         m_mapper->Write(addr, val);
         break;
     case 0xC:
+        COUNT_ACCESS(m_hw, CountWRAMWrite(0));
         m_wram[addr & 0xFFF] = val;
+        m_wram_dirty.Mark(addr & 0xFFF);
         break;
     case 0xD:
-        m_wram_map[addr & 0xFFF] = val;
+        COUNT_ACCESS(m_hw, CountWRAMWrite((m_wram_bank == 0) ? 1 : m_wram_bank));
+        m_wram[m_wram_map_offset + (addr & 0xFFF)] = val;
+        m_wram_dirty.Mark(m_wram_map_offset + (addr & 0xFFF));
         break;
     case 0xE:
+        COUNT_ACCESS(m_hw, CountWRAMWrite(0));
         m_wram[addr & 0xFFF] = val;
+        m_wram_dirty.Mark(addr & 0xFFF);
         break;
     case 0xF:
         Write_Fnnn(addr, val);
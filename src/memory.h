@@ -23,15 +23,30 @@
 #include <array>
 #include <memory>
 #include "common.h"
+#include "dirty_page_map.h"
 #include "mapper.h"
 #include "rom.h"
 
 struct Hardware;
 
-class Memory
+// Mutable memory state. Kept trivially copyable so it can be snapshotted with a plain copy.
+// Banks are stored as offsets and resolved at access time, so the state holds no pointers.
+struct MemoryState
+{
+    std::array<u8, 0x8000> m_wram; // work RAM
+    std::array<u8, 0x7F> m_hram;   // high RAM
+
+    u16 m_wram_map_offset;
+    int m_wram_bank;
+};
+
+class Memory : private MemoryState
 {
 public:
-    explicit Memory(Hardware& hw) : m_hw(hw)
+    explicit Memory(Hardware& hw) :
+        m_hw(hw),
+        m_wram_dirty(sizeof(m_wram)),
+        m_hram_dirty(sizeof(m_hram))
     {
     }
 
@@ -50,6 +65,12 @@ public:
         return m_mapper->GetRTCData();
     }
 
+    void SaveState(MemoryState& memory_state, MapperState& mapper_state) const;
+    void LoadState(const MemoryState& memory_state, const MapperState& mapper_state);
+
+    const DirtyPageMap& GetDirtyPages(MemoryRegion region);
+    void ClearDirtyPages();
+
 private:
     u8 ReadSVBK();
     void WriteSVBK(u8 val);
@@ -61,11 +82,8 @@ private:
 
     Hardware& m_hw;
 
-    std::array<u8, 0x8000> m_wram; // work RAM
-    std::array<u8, 0x7F> m_hram;   // high RAM
-
-    u8* m_wram_map;
-    int m_wram_bank;
-
     std::unique_ptr<Mapper> m_mapper;
+
+    DirtyPageMap m_wram_dirty;
+    DirtyPageMap m_hram_dirty;
 };
@@ -0,0 +1,679 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "post_process.h"
+#if defined(GBEMU_SSE2)
+#include <emmintrin.h>
+#endif
+
+// Weight of the newest frame in the moving average of frame times.
+const double frame_time_smoothing = 0.05;
+
+// Copies a width x height image into padded, with a border of the given width that repeats the
+// edge pixels.
+static void PadImage(const u32* src, unsigned int width, unsigned int height, unsigned int border,
+    std::vector<u32>& padded)
+{
+    unsigned int pitch = width + (border * 2);
+    padded.resize(pitch * (height + (border * 2)));
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        u32* row = &padded[(y + border) * pitch];
+        memcpy(row + border, src + (y * width), width * sizeof(u32));
+        std::fill_n(row, border, row[border]);
+        std::fill_n(row + border + width, border, row[border + width - 1]);
+    }
+
+    for (unsigned int i = 0; i < border; i++)
+    {
+        memcpy(&padded[i * pitch], &padded[border * pitch], pitch * sizeof(u32));
+        memcpy(&padded[(border + height + i) * pitch], &padded[(border + height - 1) * pitch], pitch * sizeof(u32));
+    }
+}
+
+static void ScaleNearest(const u32* src, unsigned int width, unsigned int height, unsigned int scale, u32* dst)
+{
+    unsigned int dst_width = width * scale;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        u32* row = dst + (y * scale * dst_width);
+
+        for (unsigned int x = 0; x < width; x++)
+        {
+            std::fill_n(row + (x * scale), scale, src[(y * width) + x]);
+        }
+
+        for (unsigned int i = 1; i < scale; i++)
+        {
+            memcpy(row + (i * dst_width), row, dst_width * sizeof(u32));
+        }
+    }
+}
+
+#if defined(GBEMU_SSE2)
+static __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Stores a0 b0 c0 a1 b1 c1 a2 b2 c2 a3 b3 c3.
+static void StoreInterleaved3(u32* dst, __m128i a, __m128i b, __m128i c)
+{
+    __m128i a_shifted = _mm_srli_si128(a, 4);
+    __m128i ab_lo = _mm_unpacklo_epi32(a, b);
+    __m128i ab_hi = _mm_unpackhi_epi32(a, b);
+    __m128i ca_lo = _mm_unpacklo_epi32(c, a_shifted);
+    __m128i ca_hi = _mm_unpackhi_epi32(c, a_shifted);
+    __m128i bc_lo = _mm_unpacklo_epi32(_mm_srli_si128(b, 4), _mm_srli_si128(c, 4));
+    __m128i bc_hi = _mm_unpackhi_epi32(b, c);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(ab_lo, ca_lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_unpacklo_epi64(bc_lo, ab_hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8), _mm_unpacklo_epi64(ca_hi, _mm_unpackhi_epi64(bc_hi, bc_hi)));
+}
+#endif
+
+// Neighbours in the padded source are named as in the Scale2x documentation:
+//   A B C
+//   D E F
+//   G H I
+// Edges are only smoothed where B != H and D != F, which keeps text and dithering intact.
+// The row pointers point at the left border column, so D is center[x] and E is center[x + 1].
+
+static void Scale2x(const std::vector<u32>& padded, unsigned int width, unsigned int height, u32* dst)
+{
+    unsigned int pitch = width + 2;
+    unsigned int dst_width = width * 2;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const u32* above = &padded[y * pitch];
+        const u32* center = above + pitch;
+        const u32* below = center + pitch;
+        u32* out0 = dst + (y * 2 * dst_width);
+        u32* out1 = out0 + dst_width;
+        unsigned int x = 0;
+
+#if defined(GBEMU_SSE2)
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x + 1));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x + 1));
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x + 2));
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + x + 1));
+
+            __m128i flat = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+            __m128i e0 = Select(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, b)), d, e);
+            __m128i e1 = Select(_mm_andnot_si128(flat, _mm_cmpeq_epi32(b, f)), f, e);
+            __m128i e2 = Select(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, h)), d, e);
+            __m128i e3 = Select(_mm_andnot_si128(flat, _mm_cmpeq_epi32(h, f)), f, e);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out0 + (x * 2)), _mm_unpacklo_epi32(e0, e1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out0 + (x * 2) + 4), _mm_unpackhi_epi32(e0, e1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out1 + (x * 2)), _mm_unpacklo_epi32(e2, e3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out1 + (x * 2) + 4), _mm_unpackhi_epi32(e2, e3));
+        }
+#endif
+
+        for (; x < width; x++)
+        {
+            u32 b = above[x + 1];
+            u32 d = center[x];
+            u32 e = center[x + 1];
+            u32 f = center[x + 2];
+            u32 h = below[x + 1];
+            bool edge = (b != h && d != f);
+
+            out0[x * 2] = (edge && d == b) ? d : e;
+            out0[x * 2 + 1] = (edge && b == f) ? f : e;
+            out1[x * 2] = (edge && d == h) ? d : e;
+            out1[x * 2 + 1] = (edge && h == f) ? f : e;
+        }
+    }
+}
+
+static void Scale3x(const std::vector<u32>& padded, unsigned int width, unsigned int height, u32* dst)
+{
+    unsigned int pitch = width + 2;
+    unsigned int dst_width = width * 3;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const u32* above = &padded[y * pitch];
+        const u32* center = above + pitch;
+        const u32* below = center + pitch;
+        u32* out0 = dst + (y * 3 * dst_width);
+        u32* out1 = out0 + dst_width;
+        u32* out2 = out1 + dst_width;
+        unsigned int x = 0;
+
+#if defined(GBEMU_SSE2)
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x + 1));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x + 2));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x + 1));
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + x + 2));
+            __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + x));
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + x + 1));
+            __m128i i = _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + x + 2));
+
+            __m128i flat = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+            __m128i db = _mm_andnot_si128(flat, _mm_cmpeq_epi32(d, b));
+            __m128i bf = _mm_andnot_si128(flat, _mm_cmpeq_epi32(b, f));
+            __m128i dh = _mm_andnot_si128(flat, _mm_cmpeq_epi32(d, h));
+            __m128i hf = _mm_andnot_si128(flat, _mm_cmpeq_epi32(h, f));
+            __m128i ea = _mm_cmpeq_epi32(e, a);
+            __m128i ec = _mm_cmpeq_epi32(e, c);
+            __m128i eg = _mm_cmpeq_epi32(e, g);
+            __m128i ei = _mm_cmpeq_epi32(e, i);
+
+            __m128i e0 = Select(db, d, e);
+            __m128i e1 = Select(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e);
+            __m128i e2 = Select(bf, f, e);
+            __m128i e3 = Select(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e);
+            __m128i e5 = Select(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e);
+            __m128i e6 = Select(dh, d, e);
+            __m128i e7 = Select(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e);
+            __m128i e8 = Select(hf, f, e);
+
+            StoreInterleaved3(out0 + (x * 3), e0, e1, e2);
+            StoreInterleaved3(out1 + (x * 3), e3, e, e5);
+            StoreInterleaved3(out2 + (x * 3), e6, e7, e8);
+        }
+#endif
+
+        for (; x < width; x++)
+        {
+            u32 a = above[x];
+            u32 b = above[x + 1];
+            u32 c = above[x + 2];
+            u32 d = center[x];
+            u32 e = center[x + 1];
+            u32 f = center[x + 2];
+            u32 g = below[x];
+            u32 h = below[x + 1];
+            u32 i = below[x + 2];
+            bool edge = (b != h && d != f);
+            bool db = edge && d == b;
+            bool bf = edge && b == f;
+            bool dh = edge && d == h;
+            bool hf = edge && h == f;
+
+            out0[x * 3] = db ? d : e;
+            out0[x * 3 + 1] = ((db && e != c) || (bf && e != a)) ? b : e;
+            out0[x * 3 + 2] = bf ? f : e;
+            out1[x * 3] = ((db && e != g) || (dh && e != a)) ? d : e;
+            out1[x * 3 + 1] = e;
+            out1[x * 3 + 2] = ((bf && e != i) || (hf && e != c)) ? f : e;
+            out2[x * 3] = dh ? d : e;
+            out2[x * 3 + 1] = ((dh && e != i) || (hf && e != g)) ? h : e;
+            out2[x * 3 + 2] = hf ? f : e;
+        }
+    }
+}
+
+// xBR: for each corner of E, compares how strongly the colors change across the two diagonals
+// around it. Where the edge runs through the corner, the corner's output pixels are blended towards
+// the neighbour on the other side, with the shape of the blend following the edge's slope.
+// Neighbours are named as for Scale2x, plus the pixels one further out beyond the bottom-right
+// corner:
+//   A B C
+//   D E F F4
+//   G H I I4
+//     H5 I5
+// The rules are written for the bottom-right corner and rotated for the other three.
+
+const unsigned int xbr_border = 2;
+
+// Pixels closer than this count as the same color. Distances are four times 8-bit YUV units.
+const int xbr_same_color_distance = 155 * 4;
+
+// Offsets from E in the padded source.
+struct XbrNeighbours
+{
+    int b, c, d, f, g, h, i, f4, i4, h5, i5;
+};
+
+enum class XbrEdge
+{
+    None,
+    // Too weak to follow; only the corner pixel is blended.
+    Soft,
+    Diagonal,
+    // Shallower than 45 degrees, running out towards G.
+    Horizontal,
+    // Steeper than 45 degrees, running out towards C.
+    Vertical,
+    // Both shallow and steep, which marks a rounded corner.
+    Both,
+};
+
+// Red and blue are weighted alike, so the result doesn't depend on the channel order.
+static void ConvertToXbrColors(const std::vector<u32>& padded, std::vector<XbrColor>& colors)
+{
+    colors.resize(padded.size());
+
+    for (size_t i = 0; i < padded.size(); i++)
+    {
+        int low = padded[i] & 0xFF;
+        int green = (padded[i] >> 8) & 0xFF;
+        int high = (padded[i] >> 16) & 0xFF;
+
+        colors[i].y = low + (green * 2) + high;
+        colors[i].u = (low - high) * 2;
+        colors[i].v = (green * 2) - low - high;
+    }
+}
+
+static int XbrDistance(const XbrColor& a, const XbrColor& b)
+{
+    return abs(a.y - b.y) + abs(a.u - b.u) + abs(a.v - b.v);
+}
+
+// Moves each 8-bit channel of a towards b by the given number of eighths of the difference.
+static u32 Blend(u32 a, u32 b, unsigned int eighths)
+{
+    u32 low = (((a & 0x00FF00FF) * (8 - eighths)) + ((b & 0x00FF00FF) * eighths)) >> 3;
+    u32 high = ((((a >> 8) & 0x00FF00FF) * (8 - eighths)) + (((b >> 8) & 0x00FF00FF) * eighths)) >> 3;
+    return (low & 0x00FF00FF) | ((high & 0x00FF00FF) << 8);
+}
+
+// Rotates an offset for the bottom-right corner a quarter turn at a time, giving the top-right,
+// top-left and bottom-left corners in turn.
+static void RotateXbrOffset(int& x, int& y, unsigned int quarter_turns)
+{
+    for (unsigned int i = 0; i < quarter_turns; i++)
+    {
+        int rotated_x = y;
+        y = -x;
+        x = rotated_x;
+    }
+}
+
+static XbrNeighbours GetXbrNeighbours(int pitch, unsigned int corner)
+{
+    auto offset = [pitch, corner](int x, int y)
+    {
+        RotateXbrOffset(x, y, corner);
+        return (y * pitch) + x;
+    };
+
+    XbrNeighbours neighbours;
+    neighbours.b = offset(0, -1);
+    neighbours.c = offset(1, -1);
+    neighbours.d = offset(-1, 0);
+    neighbours.f = offset(1, 0);
+    neighbours.g = offset(-1, 1);
+    neighbours.h = offset(0, 1);
+    neighbours.i = offset(1, 1);
+    neighbours.f4 = offset(2, 0);
+    neighbours.i4 = offset(2, 1);
+    neighbours.h5 = offset(0, 2);
+    neighbours.i5 = offset(1, 2);
+    return neighbours;
+}
+
+// Maps positions in a scale x scale block of output pixels, numbered for the bottom-right corner,
+// to where they are when rotated to the given corner.
+static void GetXbrBlockOrder(unsigned int scale, unsigned int corner, u8* order)
+{
+    int size = static_cast<int>(scale);
+
+    for (int i = 0; i < size * size; i++)
+    {
+        // Doubled coordinates around the block's center, so the center falls on a whole number.
+        int x = ((i % size) * 2) - (size - 1);
+        int y = ((i / size) * 2) - (size - 1);
+        RotateXbrOffset(x, y, corner);
+        order[i] = static_cast<u8>((((y + size - 1) / 2) * size) + ((x + size - 1) / 2));
+    }
+}
+
+// Finds the edge through one corner of the pixel at e, and the color to blend towards.
+static XbrEdge DetectXbrEdge(const u32* pixels, const XbrColor* colors, const XbrNeighbours& n, u32& blend_color)
+{
+    u32 e = pixels[0];
+
+    if (e == pixels[n.h] || e == pixels[n.f])
+    {
+        return XbrEdge::None;
+    }
+
+    auto distance = [colors](int a, int b) { return XbrDistance(colors[a], colors[b]); };
+    auto same = [&distance](int a, int b) { return distance(a, b) < xbr_same_color_distance; };
+
+    // How much the colors change crossing the E-I diagonal and crossing the F-H diagonal.
+    int across_ei = distance(0, n.c) + distance(0, n.g) + distance(n.i, n.h5) + distance(n.i, n.f4) +
+        (distance(n.h, n.f) * 4);
+    int across_fh = distance(n.h, n.d) + distance(n.h, n.i5) + distance(n.f, n.i4) + distance(n.f, n.b) +
+        (distance(0, n.i) * 4);
+
+    if (across_ei > across_fh)
+    {
+        return XbrEdge::None;
+    }
+
+    blend_color = (distance(0, n.f) <= distance(0, n.h)) ? pixels[n.f] : pixels[n.h];
+
+    bool strong = (!same(n.f, n.b) && !same(n.h, n.d)) || (same(0, n.i) && !same(n.f, n.i4) && !same(n.h, n.i5)) ||
+        same(0, n.g) || same(0, n.c);
+
+    if (across_ei == across_fh || !strong)
+    {
+        return XbrEdge::Soft;
+    }
+
+    int distance_fg = distance(n.f, n.g);
+    int distance_hc = distance(n.h, n.c);
+    bool horizontal = (distance_fg * 2 <= distance_hc) && e != pixels[n.g] && pixels[n.d] != pixels[n.g];
+    bool vertical = (distance_fg >= distance_hc * 2) && e != pixels[n.c] && pixels[n.b] != pixels[n.c];
+
+    if (horizontal && vertical)
+    {
+        return XbrEdge::Both;
+    }
+    else if (horizontal)
+    {
+        return XbrEdge::Horizontal;
+    }
+    else if (vertical)
+    {
+        return XbrEdge::Vertical;
+    }
+
+    return XbrEdge::Diagonal;
+}
+
+// Blends color into the corner of a block of output pixels, through order from GetXbrBlockOrder().
+static void BlendXbrCorner(u32* block, const u8* order, unsigned int scale, XbrEdge edge, u32 color)
+{
+    auto at = [block, order](unsigned int i) -> u32& { return block[order[i]]; };
+
+    switch (scale)
+    {
+    case 2:
+        switch (edge)
+        {
+        case XbrEdge::Both:
+            at(3) = Blend(at(3), color, 7);
+            at(2) = Blend(at(2), color, 2);
+            at(1) = at(2);
+            break;
+        case XbrEdge::Horizontal:
+            at(3) = Blend(at(3), color, 6);
+            at(2) = Blend(at(2), color, 2);
+            break;
+        case XbrEdge::Vertical:
+            at(3) = Blend(at(3), color, 6);
+            at(1) = Blend(at(1), color, 2);
+            break;
+        default:
+            at(3) = Blend(at(3), color, 4);
+            break;
+        }
+        break;
+    case 3:
+        switch (edge)
+        {
+        case XbrEdge::Both:
+            at(7) = Blend(at(7), color, 6);
+            at(6) = Blend(at(6), color, 2);
+            at(5) = at(7);
+            at(2) = at(6);
+            at(8) = color;
+            break;
+        case XbrEdge::Horizontal:
+            at(7) = Blend(at(7), color, 6);
+            at(5) = Blend(at(5), color, 2);
+            at(6) = Blend(at(6), color, 2);
+            at(8) = color;
+            break;
+        case XbrEdge::Vertical:
+            at(5) = Blend(at(5), color, 6);
+            at(7) = Blend(at(7), color, 2);
+            at(2) = Blend(at(2), color, 2);
+            at(8) = color;
+            break;
+        case XbrEdge::Diagonal:
+            at(8) = Blend(at(8), color, 7);
+            at(5) = Blend(at(5), color, 1);
+            at(7) = Blend(at(7), color, 1);
+            break;
+        default:
+            at(8) = Blend(at(8), color, 4);
+            break;
+        }
+        break;
+    case 4:
+        switch (edge)
+        {
+        case XbrEdge::Both:
+            at(13) = Blend(at(13), color, 6);
+            at(12) = Blend(at(12), color, 2);
+            at(15) = color;
+            at(14) = color;
+            at(11) = color;
+            at(10) = at(12);
+            at(3) = at(12);
+            at(7) = at(13);
+            break;
+        case XbrEdge::Horizontal:
+            at(11) = Blend(at(11), color, 6);
+            at(13) = Blend(at(13), color, 6);
+            at(10) = Blend(at(10), color, 2);
+            at(12) = Blend(at(12), color, 2);
+            at(14) = color;
+            at(15) = color;
+            break;
+        case XbrEdge::Vertical:
+            at(14) = Blend(at(14), color, 6);
+            at(7) = Blend(at(7), color, 6);
+            at(10) = Blend(at(10), color, 2);
+            at(3) = Blend(at(3), color, 2);
+            at(11) = color;
+            at(15) = color;
+            break;
+        case XbrEdge::Diagonal:
+            at(11) = Blend(at(11), color, 4);
+            at(14) = Blend(at(14), color, 4);
+            at(15) = color;
+            break;
+        default:
+            at(15) = Blend(at(15), color, 4);
+            break;
+        }
+        break;
+    }
+}
+
+// padded has an xbr_border pixel border, and colors holds ConvertToXbrColors() of it. scale is 2-4.
+static void ScaleXbr(const std::vector<u32>& padded, const std::vector<XbrColor>& colors, unsigned int width,
+    unsigned int height, unsigned int scale, u32* dst)
+{
+    unsigned int pitch = width + (xbr_border * 2);
+    unsigned int dst_width = width * scale;
+    XbrNeighbours neighbours[4];
+    u8 order[4][PostProcessor::max_scale * PostProcessor::max_scale];
+
+    for (unsigned int corner = 0; corner < 4; corner++)
+    {
+        neighbours[corner] = GetXbrNeighbours(pitch, corner);
+        GetXbrBlockOrder(scale, corner, order[corner]);
+    }
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        for (unsigned int x = 0; x < width; x++)
+        {
+            size_t center = ((y + xbr_border) * pitch) + x + xbr_border;
+            u32 block[PostProcessor::max_scale * PostProcessor::max_scale];
+            std::fill_n(block, scale * scale, padded[center]);
+
+            for (unsigned int corner = 0; corner < 4; corner++)
+            {
+                u32 color;
+                XbrEdge edge = DetectXbrEdge(&padded[center], &colors[center], neighbours[corner], color);
+
+                if (edge != XbrEdge::None)
+                {
+                    BlendXbrCorner(block, order[corner], scale, edge, color);
+                }
+            }
+
+            for (unsigned int row = 0; row < scale; row++)
+            {
+                u32* out = dst + (((y * scale) + row) * dst_width) + (x * scale);
+                memcpy(out, block + (row * scale), scale * sizeof(u32));
+            }
+        }
+    }
+}
+
+PostProcessor::PostProcessor() :
+    m_filter(ScaleFilter::Nearest),
+    m_scale(1),
+    m_input(lcd_width * lcd_height),
+    m_pending(lcd_width * lcd_height),
+    m_pending_sequence(0),
+    m_pending_filter(ScaleFilter::Nearest),
+    m_pending_scale(1),
+    m_pending_ready(false),
+    m_stop_worker(false),
+    m_average_frame_time(0.0)
+{
+    m_worker = std::thread(&PostProcessor::WorkerLoop, this);
+}
+
+PostProcessor::~PostProcessor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop_worker = true;
+    }
+
+    m_work_available.notify_one();
+    m_worker.join();
+}
+
+void PostProcessor::SetScaling(ScaleFilter filter, unsigned int scale)
+{
+    m_filter = filter;
+    m_scale = std::min(std::max(scale, 1u), max_scale);
+}
+
+void PostProcessor::Submit(const Frame& frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        memcpy(m_pending.data(), frame.pixels.data(), m_pending.size() * sizeof(u32));
+        m_pending_sequence = frame.sequence;
+        m_pending_filter = m_filter;
+        m_pending_scale = m_scale;
+        m_pending_ready = true;
+    }
+
+    m_work_available.notify_one();
+}
+
+double PostProcessor::GetAverageFrameTime()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_average_frame_time;
+}
+
+void PostProcessor::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+        m_work_available.wait(lock, [this] { return m_stop_worker || m_pending_ready; });
+
+        if (m_stop_worker)
+        {
+            return;
+        }
+
+        m_input.swap(m_pending);
+        m_pending_ready = false;
+        ScaleFilter filter = m_pending_filter;
+        unsigned int scale = m_pending_scale;
+        ScaledFrame& output = m_outputs.GetBack();
+        output.sequence = m_pending_sequence;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        Process(filter, scale, output);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        m_outputs.Publish();
+
+        lock.lock();
+        m_average_frame_time += (elapsed.count() - m_average_frame_time) * frame_time_smoothing;
+    }
+}
+
+void PostProcessor::Process(ScaleFilter filter, unsigned int scale, ScaledFrame& output)
+{
+    output.width = lcd_width * scale;
+    output.height = lcd_height * scale;
+    output.pixels.resize(output.width * output.height);
+
+    if (filter == ScaleFilter::Nearest || scale == 1)
+    {
+        ScaleNearest(m_input.data(), lcd_width, lcd_height, scale, output.pixels.data());
+        return;
+    }
+
+    if (filter == ScaleFilter::Xbr)
+    {
+        PadImage(m_input.data(), lcd_width, lcd_height, xbr_border, m_padded);
+        ConvertToXbrColors(m_padded, m_xbr_colors);
+        ScaleXbr(m_padded, m_xbr_colors, lcd_width, lcd_height, scale, output.pixels.data());
+        return;
+    }
+
+    PadImage(m_input.data(), lcd_width, lcd_height, 1, m_padded);
+
+    switch (scale)
+    {
+    case 2:
+        Scale2x(m_padded, lcd_width, lcd_height, output.pixels.data());
+        break;
+    case 3:
+        Scale3x(m_padded, lcd_width, lcd_height, output.pixels.data());
+        break;
+    case 4:
+        m_intermediate.resize(lcd_width * 2 * lcd_height * 2);
+        Scale2x(m_padded, lcd_width, lcd_height, m_intermediate.data());
+        PadImage(m_intermediate.data(), lcd_width * 2, lcd_height * 2, 1, m_padded);
+        Scale2x(m_padded, lcd_width * 2, lcd_height * 2, output.pixels.data());
+        break;
+    }
+}
@@ -0,0 +1,461 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "recorder.h"
+#if defined(GBEMU_SSE2)
+#include <emmintrin.h>
+#endif
+
+// The LCD refresh rate, 2097152 / 35112 Hz (about 59.73 Hz).
+const unsigned int frame_rate_numerator = 2097152;
+const unsigned int frame_rate_denominator = 35112;
+
+const unsigned int lcd_pixels = lcd_width * lcd_height;
+
+// Stereo 32-bit float.
+const unsigned int audio_channels = 2;
+const unsigned int audio_bytes_per_sample = 4;
+
+// WAV header fields that are only known at the end.
+const long wav_riff_size_offset = 4;
+const long wav_fact_sample_count_offset = 46;
+const long wav_data_size_offset = 54;
+const u32 wav_header_size = 58;
+
+const size_t audio_block_size = 4096;
+
+// How long the writer sleeps when there is nothing to write.
+const int writer_poll_interval_ms = 5;
+
+// BT.601 limited range, in 8.8 fixed point, in the order B, G, R.
+const int y_coefficients[3] = { 25, 129, 66 };
+const int u_coefficients[3] = { 112, -74, -38 };
+const int v_coefficients[3] = { -18, -94, 112 };
+const int y_offset = 16;
+const int uv_offset = 128;
+
+static void AppendTag(std::vector<u8>& bytes, const char* tag)
+{
+    bytes.insert(bytes.end(), tag, tag + 4);
+}
+
+static void AppendU16(std::vector<u8>& bytes, u16 val)
+{
+    bytes.push_back(val & 0xFF);
+    bytes.push_back(val >> 8);
+}
+
+static void AppendU32(std::vector<u8>& bytes, u32 val)
+{
+    AppendU16(bytes, val & 0xFFFF);
+    AppendU16(bytes, val >> 16);
+}
+
+static bool WriteU32At(BinaryFileWriter& writer, long offset, u32 val)
+{
+    std::vector<u8> bytes;
+    AppendU32(bytes, val);
+    return writer.Seek(offset) && writer.WriteBytes(bytes.data(), bytes.size());
+}
+
+// A WAVE_FORMAT_IEEE_FLOAT header with the sizes left at 0.
+static std::vector<u8> GetWAVHeader(unsigned int sample_rate)
+{
+    const u16 wave_format_ieee_float = 3;
+    const u16 block_align = audio_channels * audio_bytes_per_sample;
+
+    std::vector<u8> header;
+    AppendTag(header, "RIFF");
+    AppendU32(header, 0);
+    AppendTag(header, "WAVE");
+
+    AppendTag(header, "fmt ");
+    AppendU32(header, 18);
+    AppendU16(header, wave_format_ieee_float);
+    AppendU16(header, audio_channels);
+    AppendU32(header, sample_rate);
+    AppendU32(header, sample_rate * block_align);
+    AppendU16(header, block_align);
+    AppendU16(header, audio_bytes_per_sample * 8);
+    AppendU16(header, 0);
+
+    AppendTag(header, "fact");
+    AppendU32(header, 4);
+    AppendU32(header, 0);
+
+    AppendTag(header, "data");
+    AppendU32(header, 0);
+    return header;
+}
+
+static u8 Expand5To8(unsigned int val)
+{
+    return (val << 3) | (val >> 2);
+}
+
+static u8 Expand6To8(unsigned int val)
+{
+    return (val << 2) | (val >> 4);
+}
+
+// Converts any frame format to XRGB8888.
+static void ConvertToXRGB(const FramebufferArray& pixels, const FramebufferPalette& palette, PixelFormat format, u32* dst)
+{
+    const u8* src = reinterpret_cast<const u8*>(pixels.data());
+
+    for (unsigned int i = 0; i < lcd_pixels; i++)
+    {
+        switch (format)
+        {
+        case PixelFormat::XRGB8888:
+            memcpy(&dst[i], &src[i * 4], sizeof(u32));
+            break;
+        case PixelFormat::ABGR8888:
+        {
+            u32 color;
+            memcpy(&color, &src[i * 4], sizeof(color));
+            dst[i] = ((color & 0xFF) << 16) | (color & 0xFF00) | ((color >> 16) & 0xFF);
+            break;
+        }
+        case PixelFormat::RGB565:
+        {
+            u16 color;
+            memcpy(&color, &src[i * 2], sizeof(color));
+            dst[i] = (Expand5To8(color >> 11) << 16) | (Expand6To8((color >> 5) & 0x3F) << 8) | Expand5To8(color & 0x1F);
+            break;
+        }
+        case PixelFormat::Indexed8:
+            dst[i] = palette[src[i]];
+            break;
+        }
+    }
+}
+
+static u8 ConvertPixel(u32 color, const int* coefficients, int offset)
+{
+    int b = color & 0xFF;
+    int g = (color >> 8) & 0xFF;
+    int r = (color >> 16) & 0xFF;
+    return ((coefficients[0] * b + coefficients[1] * g + coefficients[2] * r + 128) >> 8) + offset;
+}
+
+#if defined(GBEMU_SSE2)
+// Pairs of 16-bit coefficients for _mm_madd_epi16 on pixels unpacked to B, G, R, X.
+static __m128i GetCoefficientPairs(const int* coefficients)
+{
+    return _mm_setr_epi16(coefficients[0], coefficients[1], coefficients[2], 0, coefficients[0], coefficients[1], coefficients[2], 0);
+}
+
+// Applies coefficients to 4 pixels unpacked to 16 bits, giving four 32-bit results.
+static __m128i ConvertPixels4(__m128i pixels_01, __m128i pixels_23, __m128i coefficients)
+{
+    // Each pixel gives two sums, B*cb + G*cg and R*cr, which are then added together.
+    __m128 sums_01 = _mm_castsi128_ps(_mm_madd_epi16(pixels_01, coefficients));
+    __m128 sums_23 = _mm_castsi128_ps(_mm_madd_epi16(pixels_23, coefficients));
+    __m128i bg = _mm_castps_si128(_mm_shuffle_ps(sums_01, sums_23, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i r = _mm_castps_si128(_mm_shuffle_ps(sums_01, sums_23, _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(bg, r), _mm_set1_epi32(128)), 8);
+}
+
+// Converts 16 pixels to one plane.
+static __m128i ConvertPixels16(const __m128i* unpacked, const int* coefficients, int offset)
+{
+    __m128i pairs = GetCoefficientPairs(coefficients);
+    __m128i a = ConvertPixels4(unpacked[0], unpacked[1], pairs);
+    __m128i b = ConvertPixels4(unpacked[2], unpacked[3], pairs);
+    __m128i c = ConvertPixels4(unpacked[4], unpacked[5], pairs);
+    __m128i d = ConvertPixels4(unpacked[6], unpacked[7], pairs);
+    __m128i offsets = _mm_set1_epi16(offset);
+    __m128i low = _mm_add_epi16(_mm_packs_epi32(a, b), offsets);
+    __m128i high = _mm_add_epi16(_mm_packs_epi32(c, d), offsets);
+    return _mm_packus_epi16(low, high);
+}
+#endif
+
+// Converts XRGB8888 pixels to Y, U and V planes at full resolution (4:4:4).
+static void ConvertToYUV(const u32* src, u8* y, u8* u, u8* v)
+{
+    unsigned int i = 0;
+
+#if defined(GBEMU_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= lcd_pixels; i += 16)
+    {
+        __m128i unpacked[8];
+
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i + (j * 4)]));
+            unpacked[j * 2] = _mm_unpacklo_epi8(pixels, zero);
+            unpacked[(j * 2) + 1] = _mm_unpackhi_epi8(pixels, zero);
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&y[i]), ConvertPixels16(unpacked, y_coefficients, y_offset));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&u[i]), ConvertPixels16(unpacked, u_coefficients, uv_offset));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&v[i]), ConvertPixels16(unpacked, v_coefficients, uv_offset));
+    }
+#endif
+
+    for (; i < lcd_pixels; i++)
+    {
+        y[i] = ConvertPixel(src[i], y_coefficients, y_offset);
+        u[i] = ConvertPixel(src[i], u_coefficients, uv_offset);
+        v[i] = ConvertPixel(src[i], v_coefficients, uv_offset);
+    }
+}
+
+Recorder::Recorder() :
+    m_frames(frame_queue_size),
+    m_samples(sample_queue_size),
+    m_stop_writer(false),
+    m_has_submitted_frame(false),
+    m_last_sequence(0),
+    m_pending_duplicates(0),
+    m_rgb(lcd_pixels),
+    m_yuv(lcd_pixels * 3),
+    m_audio_block(audio_block_size),
+    m_audio_data_size(0),
+    m_frames_written(0),
+    m_duplicate_frames(0),
+    m_dropped_frames(0),
+    m_dropped_samples(0)
+{
+}
+
+Recorder::~Recorder()
+{
+    Stop();
+}
+
+bool Recorder::Start(const std::string& video_file_name, const std::string& audio_file_name, unsigned int sample_rate)
+{
+    Stop();
+
+    m_video_file.reset(new BinaryFileWriter(video_file_name));
+    m_audio_file.reset(new BinaryFileWriter(audio_file_name));
+
+    char video_header[128];
+    int video_header_size = snprintf(video_header, sizeof(video_header), "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C444\n",
+        lcd_width, lcd_height, frame_rate_numerator, frame_rate_denominator);
+    std::vector<u8> audio_header = GetWAVHeader(sample_rate);
+
+    if (!m_video_file->WriteBytes(video_header, video_header_size)
+        || !m_audio_file->WriteBytes(audio_header.data(), audio_header.size()))
+    {
+        m_video_file.reset();
+        m_audio_file.reset();
+        return false;
+    }
+
+    m_frames.Reset();
+    m_samples.Reset();
+    m_has_submitted_frame = false;
+    m_pending_duplicates = 0;
+
+    // Duplicates before the first frame show black.
+    std::fill(m_yuv.begin(), m_yuv.begin() + lcd_pixels, y_offset);
+    std::fill(m_yuv.begin() + lcd_pixels, m_yuv.end(), uv_offset);
+    m_audio_data_size = 0;
+
+    m_frames_written = 0;
+    m_duplicate_frames = 0;
+    m_dropped_frames = 0;
+    m_dropped_samples = 0;
+
+    m_stop_writer = false;
+    m_writer = std::thread(&Recorder::WriterLoop, this);
+    return true;
+}
+
+bool Recorder::Stop()
+{
+    if (!IsRecording())
+    {
+        return true;
+    }
+
+    m_stop_writer.store(true, std::memory_order_release);
+    m_writer.join();
+
+    // The writer is gone, so its side can be finished from here.
+    WriteDuplicates(m_pending_duplicates);
+    m_pending_duplicates = 0;
+    FinishAudioFile();
+
+    bool ok = m_video_file->IsOK() && m_audio_file->IsOK();
+    m_video_file.reset();
+    m_audio_file.reset();
+    return ok;
+}
+
+void Recorder::SubmitFrame(const Frame& frame, PixelFormat format, unsigned int frame_count)
+{
+    if (!IsRecording() || frame_count == 0)
+    {
+        return;
+    }
+
+    if (m_has_submitted_frame && frame.sequence == m_last_sequence)
+    {
+        m_pending_duplicates += frame_count;
+        return;
+    }
+
+    m_has_submitted_frame = true;
+    m_last_sequence = frame.sequence;
+
+    QueuedFrame* queued = m_frames.BeginWrite();
+
+    if (queued == nullptr)
+    {
+        // The previous frame is repeated in its place.
+        m_dropped_frames.fetch_add(1, std::memory_order_relaxed);
+        m_pending_duplicates += frame_count;
+        return;
+    }
+
+    queued->pixels = frame.pixels;
+    queued->palette = frame.palette;
+    queued->format = format;
+    queued->duplicates_before = m_pending_duplicates;
+    m_frames.EndWrite();
+
+    m_pending_duplicates = frame_count - 1;
+}
+
+void Recorder::SubmitAudio(const float* samples, size_t count)
+{
+    if (!IsRecording())
+    {
+        return;
+    }
+
+    if (m_samples.GetWriteAvailable() < count)
+    {
+        m_dropped_samples.fetch_add(count, std::memory_order_relaxed);
+        return;
+    }
+
+    m_samples.Write(samples, count);
+}
+
+RecorderStats Recorder::GetStats() const
+{
+    RecorderStats stats;
+    stats.frames_written = m_frames_written.load(std::memory_order_relaxed);
+    stats.duplicate_frames = m_duplicate_frames.load(std::memory_order_relaxed);
+    stats.dropped_frames = m_dropped_frames.load(std::memory_order_relaxed);
+    stats.dropped_samples = m_dropped_samples.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void Recorder::WriterLoop()
+{
+    for (;;)
+    {
+        // Read before draining, so everything submitted before Stop() gets written.
+        bool stop = m_stop_writer.load(std::memory_order_acquire);
+        bool wrote = false;
+
+        while (const QueuedFrame* frame = m_frames.BeginRead())
+        {
+            WriteFrame(*frame);
+            m_frames.EndRead();
+            wrote = true;
+        }
+
+        wrote |= WriteAudio();
+
+        if (stop)
+        {
+            break;
+        }
+
+        if (!wrote)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(writer_poll_interval_ms));
+        }
+    }
+}
+
+void Recorder::WriteFrame(const QueuedFrame& frame)
+{
+    WriteDuplicates(frame.duplicates_before);
+
+    ConvertToXRGB(frame.pixels, frame.palette, frame.format, m_rgb.data());
+    ConvertToYUV(m_rgb.data(), &m_yuv[0], &m_yuv[lcd_pixels], &m_yuv[lcd_pixels * 2]);
+
+    const char frame_header[] = "FRAME\n";
+    m_video_file->WriteBytes(frame_header, sizeof(frame_header) - 1);
+    m_video_file->WriteBytes(m_yuv.data(), m_yuv.size());
+    m_frames_written.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Y4M has no way to refer back to an earlier frame, so every duplicate is a full copy of the last
+// frame: 69,120 bytes of 4:4:4 YUV plus its header, the same as a new frame. Only the RGB to YUV
+// conversion is saved. The XDUP tag is informational; players show it as an ordinary frame.
+// Skipping frames therefore saves no disk space: video takes about 4 MB per emulated second.
+void Recorder::WriteDuplicates(u32 count)
+{
+    const char frame_header[] = "FRAME XDUP\n";
+
+    for (u32 i = 0; i < count; i++)
+    {
+        m_video_file->WriteBytes(frame_header, sizeof(frame_header) - 1);
+        m_video_file->WriteBytes(m_yuv.data(), m_yuv.size());
+    }
+
+    m_frames_written.fetch_add(count, std::memory_order_relaxed);
+    m_duplicate_frames.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Returns false if there were no samples to write.
+bool Recorder::WriteAudio()
+{
+    bool wrote = false;
+
+    for (;;)
+    {
+        size_t count = m_samples.Read(m_audio_block.data(), m_audio_block.size());
+
+        if (count == 0)
+        {
+            return wrote;
+        }
+
+        m_audio_file->WriteBytes(m_audio_block.data(), count * sizeof(float));
+        m_audio_data_size += count * sizeof(float);
+        wrote = true;
+    }
+}
+
+void Recorder::FinishAudioFile()
+{
+    // The sizes are 32-bit, which is enough for about 3 hours at 48 kHz.
+    u32 data_size = static_cast<u32>(std::min<u64>(m_audio_data_size, 0xFFFFFFFFULL - wav_header_size));
+
+    WriteU32At(*m_audio_file, wav_riff_size_offset, (wav_header_size - 8) + data_size);
+    WriteU32At(*m_audio_file, wav_fact_sample_count_offset, data_size / (audio_channels * audio_bytes_per_sample));
+    WriteU32At(*m_audio_file, wav_data_size_offset, data_size);
+}
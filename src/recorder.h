@@ -0,0 +1,122 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "binary_file_writer.h"
+#include "renderer.h"
+#include "ring_buffer.h"
+
+struct RecorderStats
+{
+    // Frames written to the video file, including duplicates.
+    u64 frames_written;
+    // Frames that repeated the one before, either because no new frame was drawn or because
+    // the frame was dropped.
+    u64 duplicate_frames;
+    // New frames lost because the queue was full. Their place is taken by duplicates, so the
+    // video keeps in step with the audio.
+    u64 dropped_frames;
+    // Samples lost because the queue was full.
+    u64 dropped_samples;
+};
+
+// Records video to a Y4M file and audio to a WAV file from a writer thread. Submitting never
+// waits for the writer: if it falls behind, frames and samples are dropped and counted.
+class Recorder
+{
+public:
+    Recorder();
+    ~Recorder();
+
+    // Opens both files and starts the writer thread. Audio is stereo 32-bit float.
+    bool Start(const std::string& video_file_name, const std::string& audio_file_name, unsigned int sample_rate);
+
+    // Writes everything queued, finishes both files and stops the writer thread. Returns false
+    // if anything couldn't be written.
+    bool Stop();
+
+    bool IsRecording() const
+    {
+        return m_writer.joinable();
+    }
+
+    // Emulation side. These must be called from the same thread.
+
+    // Adds the frame shown for the next frame_count emulated frames. A frame with the same
+    // sequence as the last one submitted is recorded as duplicates.
+    void SubmitFrame(const Frame& frame, PixelFormat format, unsigned int frame_count);
+
+    // Adds interleaved stereo samples. A block that doesn't fit in the queue is dropped whole.
+    void SubmitAudio(const float* samples, size_t count);
+
+    RecorderStats GetStats() const;
+
+private:
+    struct QueuedFrame
+    {
+        FramebufferArray pixels;
+        FramebufferPalette palette;
+        PixelFormat format;
+        // Duplicates of the previous frame to write first.
+        u32 duplicates_before;
+    };
+
+    void WriterLoop();
+    void WriteFrame(const QueuedFrame& frame);
+    void WriteDuplicates(u32 count);
+    bool WriteAudio();
+    void FinishAudioFile();
+
+    static const size_t frame_queue_size = 32;
+    static const size_t sample_queue_size = 1 << 18;
+
+    std::unique_ptr<BinaryFileWriter> m_video_file;
+    std::unique_ptr<BinaryFileWriter> m_audio_file;
+
+    RingBuffer<QueuedFrame> m_frames;
+    RingBuffer<float> m_samples;
+
+    std::thread m_writer;
+    std::atomic<bool> m_stop_writer;
+
+    // Owned by the emulation thread.
+    bool m_has_submitted_frame;
+    u64 m_last_sequence;
+    u32 m_pending_duplicates;
+
+    // Owned by the writer thread. The last frame converted, as Y, U and V planes, is kept so
+    // duplicates don't need converting again.
+    std::vector<u32> m_rgb;
+    std::vector<u8> m_yuv;
+    std::vector<float> m_audio_block;
+    u64 m_audio_data_size;
+
+    std::atomic<u64> m_frames_written;
+    std::atomic<u64> m_duplicate_frames;
+    std::atomic<u64> m_dropped_frames;
+    std::atomic<u64> m_dropped_samples;
+};
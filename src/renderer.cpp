@@ -0,0 +1,1606 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include "common.h"
+#include "renderer.h"
+#if defined(GBEMU_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(GBEMU_AVX2)
+#include <immintrin.h>
+#endif
+
+const u64 bytewise_ones = 0x0101010101010101ULL;
+
+const int total_sprites = 40;
+const int oam_entry_size = 4;
+
+// OAM entry offsets
+const int oam_y = 0;
+const int oam_x = 1;
+const int oam_tile_num = 2;
+const int oam_attr = 3;
+
+// OAM attributes
+
+const int oam_attr_cgb_pal_shift = 0;
+const int oam_attr_vram_bank_shift = 3;
+const int oam_attr_dmg_pal_shift = 4;
+const int oam_attr_flip_x_shift = 5;
+const int oam_attr_flip_y_shift = 6;
+const int oam_attr_priority_shift = 7;
+
+const unsigned int oam_attr_cgb_pal_mask = 0x7;
+const unsigned int oam_attr_vram_bank_mask = 0x1;
+const unsigned int oam_attr_dmg_pal_mask = 0x1;
+
+const unsigned int oam_attr_flip_x = Bit(oam_attr_flip_x_shift);
+const unsigned int oam_attr_flip_y = Bit(oam_attr_flip_y_shift);
+const unsigned int oam_attr_priority = Bit(oam_attr_priority_shift);
+
+// BG attributes
+
+const int bg_attr_pal_shift = 0;
+const int bg_attr_vram_bank_shift = 3;
+const int bg_attr_flip_x_shift = 5;
+const int bg_attr_flip_y_shift = 6;
+const int bg_attr_priority_shift = 7;
+
+const unsigned int bg_attr_pal_mask = 0x7;
+const unsigned int bg_attr_vram_bank_mask = 0x1;
+
+const unsigned int bg_attr_flip_x = Bit(bg_attr_flip_x_shift);
+const unsigned int bg_attr_flip_y = Bit(bg_attr_flip_y_shift);
+const unsigned int bg_attr_priority = Bit(bg_attr_priority_shift);
+
+unsigned int GetBytesPerPixel(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::XRGB8888:
+    case PixelFormat::ABGR8888:
+        return 4;
+    case PixelFormat::RGB565:
+        return 2;
+    case PixelFormat::Indexed8:
+        return 1;
+    }
+
+    return 4;
+}
+
+// BT.601 luma of a color in the given format. Indexed8 palettes are XRGB8888.
+static u8 GetLuma(u32 color, PixelFormat format)
+{
+    unsigned int r = (color >> 16) & 0xFF;
+    unsigned int g = (color >> 8) & 0xFF;
+    unsigned int b = color & 0xFF;
+
+    switch (format)
+    {
+    case PixelFormat::XRGB8888:
+    case PixelFormat::Indexed8:
+        break;
+    case PixelFormat::ABGR8888:
+        r = color & 0xFF;
+        g = (color >> 8) & 0xFF;
+        b = (color >> 16) & 0xFF;
+        break;
+    case PixelFormat::RGB565:
+        r = ((color >> 11) & 0x1F) * 255 / 31;
+        g = ((color >> 5) & 0x3F) * 255 / 63;
+        b = (color & 0x1F) * 255 / 31;
+        break;
+    }
+
+    return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+Renderer::Renderer(bool is_cgb_mode) :
+    m_is_cgb_mode(is_cgb_mode),
+    m_line(),
+    m_tile_data_generation(0),
+    m_layers(2),
+    m_sprite_lists_8x16(false),
+    m_pixel_format(PixelFormat::XRGB8888),
+    m_host_framebuffer(nullptr),
+    m_host_framebuffer_pitch(0),
+    m_indexed_palette_changed(false),
+    m_frame_lines_drawn(false),
+    m_observation(nullptr),
+    m_observation_width(0),
+    m_observation_height(0),
+    m_observation_format(ObservationFormat::Grayscale),
+    m_observation_line_pending(false),
+    m_tile_grid(nullptr),
+    m_tile_grid_sprite_mask(0),
+    m_worker_busy(false),
+    m_stop_worker(false)
+{
+    m_vram = {};
+    m_oam = {};
+    m_tile_versions = {};
+    MarkAllTilesDirty();
+    MarkAllLayersDirty();
+    m_sprite_lists_dirty = true;
+    m_palette = {};
+    m_palette_luma = {};
+    m_indexed_palette = {};
+    m_line_entries = {};
+    m_bg_color_indices = {};
+    m_bg_high_priority = {};
+    ClearFramebuffers();
+}
+
+Renderer::~Renderer()
+{
+    StopWorker();
+}
+
+void Renderer::SetThreaded(bool threaded)
+{
+    if (threaded == IsThreaded())
+    {
+        return;
+    }
+
+    if (threaded)
+    {
+        m_stop_worker = false;
+        m_worker = std::thread(&Renderer::WorkerLoop, this);
+    }
+    else
+    {
+        StopWorker();
+    }
+}
+
+void Renderer::Sync()
+{
+    if (!IsThreaded())
+    {
+        return;
+    }
+
+    Submit();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_work_done.wait(lock, [this] { return m_submitted.empty() && !m_worker_busy; });
+}
+
+void Renderer::WriteVRAM(u16 offset, u8 val)
+{
+    Command command;
+    command.type = CommandType::WriteVRAM;
+    command.memory_write = { offset, val };
+    Record(command);
+}
+
+void Renderer::WriteOAM(u16 offset, u8 val)
+{
+    Command command;
+    command.type = CommandType::WriteOAM;
+    command.memory_write = { offset, val };
+    Record(command);
+}
+
+void Renderer::SetPaletteEntry(unsigned int entry, u32 color)
+{
+    Command command;
+    command.type = CommandType::SetPaletteEntry;
+    command.palette_write = { entry, color };
+    Record(command);
+}
+
+void Renderer::BeginFrame()
+{
+    Command command;
+    command.type = CommandType::BeginFrame;
+    Record(command);
+}
+
+void Renderer::DrawLine(const LineRegisters& regs)
+{
+    Command command;
+    command.type = CommandType::DrawLine;
+    command.line = regs;
+    Record(command);
+}
+
+void Renderer::ChangeLineRegisters(unsigned int x, const LineRegisters& regs)
+{
+    Command command;
+    command.type = CommandType::ChangeLineRegisters;
+    command.register_change.x = x;
+    command.register_change.regs = regs;
+    Record(command);
+}
+
+void Renderer::RedrawChangedLine()
+{
+    Command command;
+    command.type = CommandType::RedrawChangedLine;
+    Record(command);
+}
+
+void Renderer::EndFrame(u64 sequence)
+{
+    Command command;
+    command.type = CommandType::EndFrame;
+    command.sequence = sequence;
+    Record(command);
+}
+
+void Renderer::ClearFrame(u64 sequence)
+{
+    Command command;
+    command.type = CommandType::ClearFrame;
+    command.sequence = sequence;
+    Record(command);
+}
+
+void Renderer::LoadMemory(const std::array<u8, 0x4000>& vram, const std::array<u8, 0xA0>& oam)
+{
+    Sync();
+    m_vram = vram;
+    m_oam = oam;
+    MarkAllTilesDirty();
+    MarkAllLayersDirty();
+    m_sprite_lists_dirty = true;
+    ResetLineChanges();
+}
+
+void Renderer::ClearFramebuffers()
+{
+    Sync();
+    m_frames.Reset();
+
+    // Blank frames are black, as when the LCD is off.
+    int fill = (m_pixel_format == PixelFormat::Indexed8) ? lcd_off_palette_entry : 0;
+
+    for (Frame& frame : m_frames.GetBuffers())
+    {
+        memset(frame.pixels.data(), fill, sizeof(frame.pixels));
+        frame.palette = {};
+        frame.palette_changed = false;
+        frame.sequence = 0;
+        frame.changed_lines.set();
+    }
+
+    InvalidateLineHashes();
+    ResetLineChanges();
+}
+
+void Renderer::SetPixelFormat(PixelFormat format)
+{
+    Sync();
+    m_pixel_format = format;
+    ClearFramebuffers();
+}
+
+void Renderer::SetHostFramebuffer(void* pixels, unsigned int pitch)
+{
+    Sync();
+    m_host_framebuffer = static_cast<u8*>(pixels);
+    m_host_framebuffer_pitch = pitch;
+    InvalidateLineHashes();
+}
+
+// Each output pixel covers an area of the LCD, and an LCD pixel can straddle two output pixels.
+// The weights are the overlaps in output pixels, so the weights of the area an output pixel
+// covers add up to 1 and the sums don't need dividing.
+bool Renderer::SetObservationBuffer(u8* buffer, unsigned int width, unsigned int height, ObservationFormat format)
+{
+    if (buffer != nullptr && (width == 0 || width > lcd_width || height == 0 || height > lcd_height))
+    {
+        return false;
+    }
+
+    Sync();
+    m_observation = buffer;
+    m_observation_width = width;
+    m_observation_height = height;
+    m_observation_format = format;
+    m_observation_line_pending = false;
+
+    // Lines weren't resolved while observing, so the hashes don't match the frames.
+    InvalidateLineHashes();
+
+    if (buffer == nullptr)
+    {
+        return true;
+    }
+
+    m_observation_column_weight = (float)width / lcd_width;
+    m_observation_row_weight = (float)height / lcd_height;
+
+    for (unsigned int x = 0; x < lcd_width; x++)
+    {
+        unsigned int column = (x * width) / lcd_width;
+        m_observation_columns[x] = column;
+        m_observation_column_weights[x] = std::min((float)((x + 1) * width) / lcd_width, (float)column + 1) - (float)(x * width) / lcd_width;
+    }
+
+    for (unsigned int y = 0; y < lcd_height; y++)
+    {
+        unsigned int row = (y * height) / lcd_height;
+        m_observation_rows[y] = row;
+        m_observation_row_weights[y] = std::min((float)((y + 1) * height) / lcd_height, (float)row + 1) - (float)(y * height) / lcd_height;
+    }
+
+    // Palette entries are taken from the LCD pixels at the centers of the output pixels.
+    m_observation_sample_rows.fill(-1);
+
+    for (unsigned int i = 0; i < width; i++)
+    {
+        m_observation_sample_columns[i] = ((2 * i + 1) * lcd_width) / (2 * width);
+    }
+
+    for (unsigned int i = 0; i < height; i++)
+    {
+        m_observation_sample_rows[((2 * i + 1) * lcd_height) / (2 * height)] = i;
+    }
+
+    // One extra column and row take the zero weights past the last ones.
+    m_observation_stride = (width + 1 + 3) & ~3;
+    m_observation_row.assign(m_observation_stride, 0.0f);
+    m_observation_sums.assign(m_observation_stride * (height + 1), 0.0f);
+    return true;
+}
+
+void Renderer::SetTileGrid(TileGrid* grid)
+{
+    Sync();
+    m_tile_grid = grid;
+
+    if (grid != nullptr)
+    {
+        ResetTileGrid();
+        grid->sequence = 0;
+    }
+}
+
+void Renderer::Record(const Command& command)
+{
+    if (!IsThreaded())
+    {
+        Execute(command);
+        return;
+    }
+
+    m_recorded.push_back(command);
+
+    if (command.type == CommandType::EndFrame
+        || command.type == CommandType::ClearFrame
+        || m_recorded.size() >= max_recorded_commands)
+    {
+        Submit();
+    }
+}
+
+void Renderer::Execute(const Command& command)
+{
+    switch (command.type)
+    {
+    case CommandType::WriteVRAM:
+        m_vram[command.memory_write.offset] = command.memory_write.val;
+        MarkTileDirty(command.memory_write.offset);
+        MarkLayerCellDirty(command.memory_write.offset);
+        break;
+    case CommandType::WriteOAM:
+        m_oam[command.memory_write.offset] = command.memory_write.val;
+        m_sprite_lists_dirty = true;
+        break;
+    case CommandType::SetPaletteEntry:
+        if (!m_line_changes.empty())
+        {
+            LineChange change = {};
+            change.x = m_line_changes.back().x;
+            change.is_palette_entry = true;
+            change.entry = command.palette_write.entry;
+            change.color = command.palette_write.color;
+            m_line_changes.push_back(change);
+        }
+        m_palette[command.palette_write.entry] = command.palette_write.color;
+        m_palette_luma[command.palette_write.entry] = GetLuma(command.palette_write.color, m_pixel_format);
+        if (m_pixel_format == PixelFormat::Indexed8)
+        {
+            SetIndexedColor(command.palette_write.color);
+        }
+        break;
+    case CommandType::BeginFrame:
+        // Lines that don't get drawn, such as the first line after a reset, are left with
+        // stale contents, so they count as changed.
+        m_frames.GetBack().changed_lines.set();
+        m_frame_lines_drawn = false;
+        ResetLineChanges();
+        ResetObservation();
+        if (m_tile_grid != nullptr)
+        {
+            ResetTileGrid();
+        }
+        break;
+    case CommandType::DrawLine:
+        if (m_observation_line_pending)
+        {
+            AddObservationLine();
+        }
+        m_line = command.line;
+        m_frame_lines_drawn = true;
+        DrawScanline();
+        break;
+    case CommandType::ChangeLineRegisters:
+    {
+        if (m_line_changes.empty())
+        {
+            m_line_start_palette = m_palette;
+        }
+
+        LineChange change = {};
+        change.x = command.register_change.x;
+        change.regs = command.register_change.regs;
+        m_line_changes.push_back(change);
+        break;
+    }
+    case CommandType::RedrawChangedLine:
+        DrawChangedLine();
+        ResetLineChanges();
+        break;
+    case CommandType::EndFrame:
+        ExecuteEndFrame(command.sequence);
+        break;
+    case CommandType::ClearFrame:
+        ExecuteClearFrame(command.sequence);
+        break;
+    }
+}
+
+// Hands the recorded commands to the worker, waiting if it hasn't started on the previous batch.
+void Renderer::Submit()
+{
+    if (m_recorded.empty())
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_work_done.wait(lock, [this] { return m_submitted.empty(); });
+    m_submitted.swap(m_recorded);
+    lock.unlock();
+    m_work_available.notify_one();
+}
+
+void Renderer::StopWorker()
+{
+    if (!m_worker.joinable())
+    {
+        return;
+    }
+
+    Submit();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop_worker = true;
+    }
+
+    m_work_available.notify_one();
+    m_worker.join();
+}
+
+void Renderer::WorkerLoop()
+{
+    std::vector<Command> commands;
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+        m_work_available.wait(lock, [this] { return m_stop_worker || !m_submitted.empty(); });
+
+        if (m_submitted.empty())
+        {
+            return;
+        }
+
+        commands.swap(m_submitted);
+        m_worker_busy = true;
+        lock.unlock();
+        m_work_done.notify_all();
+
+        for (const Command& command : commands)
+        {
+            Execute(command);
+        }
+
+        commands.clear();
+
+        lock.lock();
+        m_worker_busy = false;
+        m_work_done.notify_all();
+    }
+}
+
+// Records the color of an Indexed8 palette value under the index it's written as.
+void Renderer::SetIndexedColor(u32 color)
+{
+    unsigned int index = color >> 24;
+    u32 rgb = color & 0xFFFFFF;
+
+    if (m_indexed_palette[index] != rgb)
+    {
+        m_indexed_palette[index] = rgb;
+        m_indexed_palette_changed |= m_frame_lines_drawn;
+    }
+}
+
+void Renderer::ExecuteEndFrame(u64 sequence)
+{
+    if (m_observation != nullptr)
+    {
+        FinishObservation();
+    }
+
+    if (m_tile_grid != nullptr)
+    {
+        m_tile_grid->sequence = sequence;
+    }
+
+    Frame& frame = m_frames.GetBack();
+    frame.palette = m_indexed_palette;
+    frame.palette_changed = m_indexed_palette_changed;
+    frame.sequence = sequence;
+    m_frames.Publish();
+
+    // Palette writes between frames don't affect either of them.
+    m_indexed_palette_changed = false;
+    m_frame_lines_drawn = false;
+}
+
+void Renderer::ExecuteClearFrame(u64 sequence)
+{
+    // Zero is black in the other formats.
+    int fill = (m_pixel_format == PixelFormat::Indexed8) ? lcd_off_palette_entry : 0;
+
+    if (m_host_framebuffer != nullptr)
+    {
+        for (int y = 0; y < lcd_height; y++)
+        {
+            memset(m_host_framebuffer + (y * m_host_framebuffer_pitch), fill, GetFramebufferPitch());
+        }
+    }
+
+    FramebufferArray& pixels = m_frames.GetBack().pixels;
+    memset(pixels.data(), fill, lcd_height * GetFramebufferPitch());
+    m_frames.GetBack().changed_lines.set();
+    ResetObservation();
+
+    if (m_tile_grid != nullptr)
+    {
+        ResetTileGrid();
+
+        for (TileGridCell& cell : m_tile_grid->cells)
+        {
+            cell.flags = tile_grid_blank;
+        }
+    }
+
+    ExecuteEndFrame(sequence);
+    InvalidateLineHashes();
+    ResetLineChanges();
+}
+
+void Renderer::MarkTileDirty(unsigned int vram_offset)
+{
+    unsigned int bank_offset = vram_offset & 0x1FFF;
+
+    if (bank_offset < 0x1800)
+    {
+        unsigned int tile = ((vram_offset >> 13) * tiles_per_bank) + (bank_offset >> 4);
+        m_tile_dirty[tile] = true;
+        m_any_tile_dirty = true;
+        m_tile_versions[tile]++;
+        m_tile_data_generation++;
+    }
+}
+
+void Renderer::MarkAllTilesDirty()
+{
+    m_tile_dirty.fill(true);
+    m_any_tile_dirty = true;
+}
+
+void Renderer::UpdateTileCache()
+{
+    if (!m_any_tile_dirty)
+    {
+        return;
+    }
+
+    for (int tile = 0; tile < total_tiles; tile++)
+    {
+        if (!m_tile_dirty[tile])
+        {
+            continue;
+        }
+
+        unsigned int offset = ((tile / tiles_per_bank) * 0x2000) + ((tile % tiles_per_bank) * 16);
+        DecodedTile& decoded = m_tile_cache[tile];
+
+        for (int y = 0; y < tile_height; y++)
+        {
+            u8 plane1 = m_vram[offset + (y * 2)];
+            u8 plane2 = m_vram[offset + (y * 2) + 1];
+
+            for (int x = 0; x < tile_width; x++)
+            {
+                unsigned int shift = (tile_width - 1) - x;
+                u8 pixel = ((plane1 >> shift) & 1) | (((plane2 >> shift) << 1) & 2);
+                decoded[0][y][x] = pixel;
+                decoded[1][y][(tile_width - 1) - x] = pixel;
+            }
+        }
+
+        m_tile_dirty[tile] = false;
+    }
+
+    m_any_tile_dirty = false;
+}
+
+const Renderer::TileRow& Renderer::GetBackgroundTileRow(
+    const u8* tilemap,
+    unsigned int tile_x,
+    unsigned int tile_y,
+    unsigned int tile_fine_y,
+    unsigned int vram_bank,
+    bool flip_x,
+    bool flip_y)
+{
+    if (flip_y)
+    {
+        tile_fine_y = (tile_height - 1) - tile_fine_y;
+    }
+
+    u8 tile_num = tilemap[(tile_y * virtual_screen_width) + tile_x];
+    unsigned int tile;
+
+    if (m_line.pattern_table_8000)
+    {
+        // 8000-8FFF
+        tile = tile_num;
+    }
+    else
+    {
+        // 8800-97FF
+        tile = 256 + (s8)tile_num;
+    }
+
+    tile += vram_bank * tiles_per_bank;
+
+    return m_tile_cache[tile][flip_x][tile_fine_y];
+}
+
+void Renderer::MarkLayerCellDirty(unsigned int vram_offset)
+{
+    // Tilemaps are in bank 0 and their attributes at the same offsets in bank 1.
+    unsigned int bank_offset = vram_offset & 0x1FFF;
+
+    if (bank_offset >= 0x1800)
+    {
+        Layer& layer = m_layers[(bank_offset >> 10) & 1];
+        unsigned int cell = bank_offset & 0x3FF;
+        layer.cell_dirty[cell] = true;
+        layer.row_dirty[cell / virtual_screen_width] = true;
+    }
+}
+
+void Renderer::MarkAllLayersDirty()
+{
+    for (Layer& layer : m_layers)
+    {
+        layer.cell_dirty.fill(true);
+        layer.row_dirty.fill(true);
+        layer.pattern_table_8000 = true;
+    }
+}
+
+Renderer::Layer& Renderer::GetLayer(u16 tilemap_offset)
+{
+    return m_layers[(tilemap_offset >> 10) & 1];
+}
+
+// Brings a row of cells up to date. In the common case, where no tilemap entry on the row has
+// been written and no tile data at all has changed, this is a couple of comparisons.
+void Renderer::UpdateLayerRow(Layer& layer, u16 tilemap_offset, u16 attr_table_offset, unsigned int tile_y)
+{
+    if (layer.pattern_table_8000 != m_line.pattern_table_8000)
+    {
+        layer.pattern_table_8000 = m_line.pattern_table_8000;
+        layer.row_dirty.fill(true);
+    }
+
+    if (!layer.row_dirty[tile_y] && layer.row_generations[tile_y] == m_tile_data_generation)
+    {
+        return;
+    }
+
+    for (unsigned int tile_x = 0; tile_x < virtual_screen_width; tile_x++)
+    {
+        unsigned int cell = (tile_y * virtual_screen_width) + tile_x;
+        u8 tile_num = m_vram[tilemap_offset + cell];
+        u8 attr = m_is_cgb_mode ? m_vram[attr_table_offset + cell] : 0;
+        unsigned int vram_bank = (attr >> bg_attr_vram_bank_shift) & bg_attr_vram_bank_mask;
+
+        // 8000-8FFF, or 8800-97FF with signed tile numbers
+        unsigned int tile = m_line.pattern_table_8000 ? tile_num : 256 + (s8)tile_num;
+        tile += vram_bank * tiles_per_bank;
+
+        if (!layer.cell_dirty[cell] && layer.cell_tiles[cell] == tile && layer.cell_tile_versions[cell] == m_tile_versions[tile])
+        {
+            continue;
+        }
+
+        unsigned int pal_slot = (attr >> bg_attr_pal_shift) & bg_attr_pal_mask;
+        bool flip_x = ((attr & bg_attr_flip_x) != 0);
+        bool flip_y = ((attr & bg_attr_flip_y) != 0);
+        u64 entry_base = pal_slot * 4 * bytewise_ones;
+        u64 priority = ((attr & bg_attr_priority) != 0) ? ~0ULL : 0;
+
+        for (int fine_y = 0; fine_y < tile_height; fine_y++)
+        {
+            const TileRow& row = m_tile_cache[tile][flip_x][flip_y ? (tile_height - 1) - fine_y : fine_y];
+            unsigned int pos = (((tile_y * tile_height) + fine_y) * layer_size) + (tile_x * tile_width);
+
+            u64 pixels;
+            memcpy(&pixels, row.data(), tile_width);
+            u64 entries = pixels | entry_base;
+            memcpy(&layer.color_indices[pos], &pixels, tile_width);
+            memcpy(&layer.entries[pos], &entries, tile_width);
+            memcpy(&layer.high_priority[pos], &priority, tile_width);
+        }
+
+        layer.cell_tiles[cell] = tile;
+        layer.cell_tile_versions[cell] = m_tile_versions[tile];
+        layer.cell_dirty[cell] = false;
+    }
+
+    layer.row_dirty[tile_y] = false;
+    layer.row_generations[tile_y] = m_tile_data_generation;
+}
+
+// Copies a layer row, starting at layer_x and wrapping around, into the line buffers from
+// screen position x to the end of the line.
+void Renderer::CopyLayerRow(const Layer& layer, unsigned int layer_x, unsigned int layer_y, int x)
+{
+    unsigned int row = layer_y * layer_size;
+
+    while (x < lcd_width)
+    {
+        unsigned int count = std::min<unsigned int>(lcd_width - x, layer_size - layer_x);
+        unsigned int pos = line_padding + x;
+        memcpy(&m_line_entries[pos], &layer.entries[row + layer_x], count);
+        memcpy(&m_bg_color_indices[pos], &layer.color_indices[row + layer_x], count);
+        memcpy(&m_bg_high_priority[pos], &layer.high_priority[row + layer_x], count);
+        x += count;
+        layer_x = 0;
+    }
+}
+
+void Renderer::DrawBackground()
+{
+    unsigned int line = (m_line.ly + m_line.scy) & 0xFF;
+    Layer& layer = GetLayer(m_line.bg_tilemap_offset);
+
+    UpdateLayerRow(layer, m_line.bg_tilemap_offset, m_line.bg_attr_table_offset, line / tile_height);
+    CopyLayerRow(layer, m_line.scx, line, 0);
+}
+
+void Renderer::DrawWindow()
+{
+    int window_x = m_line.wx - 7;
+    Layer& layer = GetLayer(m_line.window_tilemap_offset);
+
+    UpdateLayerRow(layer, m_line.window_tilemap_offset, m_line.window_attr_table_offset, m_line.window_line / tile_height);
+
+    // A window starting left of the screen has its first columns cut off.
+    CopyLayerRow(layer, std::max(-window_x, 0), m_line.window_line, std::max(window_x, 0));
+}
+
+void Renderer::WhiteOutScanline()
+{
+    std::fill(m_line_entries.begin(), m_line_entries.end(), dmg_blank_palette_entry);
+    m_bg_color_indices.fill(0);
+    m_bg_high_priority.fill(0);
+}
+
+u8* Renderer::GetScanlineDestination()
+{
+    if (m_host_framebuffer != nullptr)
+    {
+        return m_host_framebuffer + (m_line.ly * m_host_framebuffer_pitch);
+    }
+
+    u8* fb = reinterpret_cast<u8*>(m_frames.GetBack().pixels.data());
+    return fb + (m_line.ly * GetFramebufferPitch());
+}
+
+void Renderer::ResolveScanline(u8* dst)
+{
+    const u8* entries = &m_line_entries[line_padding];
+
+    // The destination may be host memory with no particular alignment, so pixels are stored
+    // with memcpy or unaligned stores.
+    switch (m_pixel_format)
+    {
+    case PixelFormat::XRGB8888:
+    case PixelFormat::ABGR8888:
+#if defined(GBEMU_AVX2)
+        for (int x = 0; x < lcd_width; x += 8)
+        {
+            __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&entries[x]));
+            __m256i indices = _mm256_cvtepu8_epi32(packed);
+            __m256i colors = _mm256_i32gather_epi32(reinterpret_cast<const int*>(m_palette.data()), indices, 4);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[x * 4]), colors);
+        }
+#else
+        for (int x = 0; x < lcd_width; x++)
+        {
+            u32 color = m_palette[entries[x]];
+            memcpy(&dst[x * 4], &color, sizeof(color));
+        }
+#endif
+        break;
+    case PixelFormat::RGB565:
+        for (int x = 0; x < lcd_width; x++)
+        {
+            u16 color = m_palette[entries[x]];
+            memcpy(&dst[x * 2], &color, sizeof(color));
+        }
+        break;
+    case PixelFormat::Indexed8:
+        for (int x = 0; x < lcd_width; x++)
+        {
+            dst[x] = static_cast<u8>(m_palette[entries[x]] >> 24);
+        }
+        break;
+    }
+}
+
+void Renderer::InvalidateLineHashes()
+{
+    // Any value works as long as it's unlikely to match a real line.
+    m_line_hashes.fill(~0ULL);
+}
+
+void Renderer::UpdateLineHash(const u8* dst)
+{
+    unsigned int line_size = GetFramebufferPitch();
+    u64 hash = 0xCBF29CE484222325ULL;
+
+    for (unsigned int i = 0; i < line_size; i += sizeof(u64))
+    {
+        u64 word;
+        memcpy(&word, &dst[i], sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+
+    m_frames.GetBack().changed_lines[m_line.ly] = (hash != m_line_hashes[m_line.ly]);
+    m_line_hashes[m_line.ly] = hash;
+}
+
+void Renderer::DrawScanline()
+{
+    UpdateTileCache();
+
+    if (m_line.bg_enable || m_is_cgb_mode)
+    {
+        DrawBackground();
+    }
+    else
+    {
+        WhiteOutScanline();
+    }
+
+    if (m_line.window_visible)
+    {
+        DrawWindow();
+    }
+
+    if (m_line.sprite_enable)
+    {
+        DrawSprites();
+    }
+
+    if (m_tile_grid != nullptr && (m_line.ly % tile_height) == 0)
+    {
+        AddTileGridRow();
+    }
+
+    if (m_observation != nullptr)
+    {
+        const u8* entries = &m_line_entries[line_padding];
+
+        if (m_observation_format == ObservationFormat::Grayscale)
+        {
+            for (int x = 0; x < lcd_width; x++)
+            {
+                m_observation_line[x] = m_palette_luma[entries[x]];
+            }
+        }
+        else
+        {
+            memcpy(m_observation_line.data(), entries, lcd_width);
+        }
+
+        m_observation_line_pending = true;
+        return;
+    }
+
+    u8* dst = GetScanlineDestination();
+    ResolveScanline(dst);
+    m_replaced_line_hash = m_line_hashes[m_line.ly];
+    UpdateLineHash(dst);
+}
+
+void Renderer::UpdateSpriteLists()
+{
+    if (m_line.sprite_size_8x16 != m_sprite_lists_8x16)
+    {
+        m_sprite_lists_8x16 = m_line.sprite_size_8x16;
+        m_sprite_lists_dirty = true;
+    }
+
+    if (!m_sprite_lists_dirty)
+    {
+        return;
+    }
+
+    const int sprite_height = m_line.sprite_size_8x16 ? 16 : 8;
+
+    for (LineSprites& line_sprites : m_line_sprites)
+    {
+        line_sprites.count = 0;
+    }
+
+    for (int i = 0; i < total_sprites; i++)
+    {
+        int sprite_y = m_oam[i * oam_entry_size + oam_y] - 16;
+        u8 sprite_x = m_oam[i * oam_entry_size + oam_x];
+
+        int first_line = std::max(sprite_y, 0);
+        int last_line = std::min(sprite_y + sprite_height, lcd_height);
+
+        for (int line = first_line; line < last_line; line++)
+        {
+            LineSprites& line_sprites = m_line_sprites[line];
+            int pos = line_sprites.count;
+
+            if (!m_is_cgb_mode)
+            {
+                // Keep the list ordered by X, with OAM order breaking ties. Sprites are visited
+                // in OAM order, so a new sprite goes after all of those with the same X.
+                while (pos > 0 && m_oam[line_sprites.sprites[pos - 1] * oam_entry_size + oam_x] > sprite_x)
+                {
+                    pos--;
+                }
+            }
+
+            if (pos >= per_line_sprite_limit)
+            {
+                continue;
+            }
+
+            int end = std::min(line_sprites.count + 1, per_line_sprite_limit);
+
+            for (int j = end - 1; j > pos; j--)
+            {
+                line_sprites.sprites[j] = line_sprites.sprites[j - 1];
+            }
+
+            line_sprites.sprites[pos] = i;
+            line_sprites.count = end;
+        }
+    }
+
+    m_sprite_lists_dirty = false;
+}
+
+Renderer::SpriteRow Renderer::GetSpriteRow(unsigned int sprite_index)
+{
+    const int sprite_height = m_line.sprite_size_8x16 ? 16 : 8;
+    unsigned int oam_offset = sprite_index * oam_entry_size;
+
+    int sprite_y = m_oam[oam_offset + oam_y] - 16;
+    u8 tile_num = m_oam[oam_offset + oam_tile_num];
+    u8 attr = m_oam[oam_offset + oam_attr];
+
+    if (m_line.sprite_size_8x16)
+    {
+        tile_num &= ~1;
+    }
+
+    unsigned int pal_slot;
+
+    if (m_is_cgb_mode)
+    {
+        pal_slot = (attr >> oam_attr_cgb_pal_shift) & oam_attr_cgb_pal_mask;
+    }
+    else
+    {
+        pal_slot = (attr >> oam_attr_dmg_pal_shift) & oam_attr_dmg_pal_mask;
+    }
+
+    unsigned int vram_bank = m_is_cgb_mode ? ((attr >> oam_attr_vram_bank_shift) & oam_attr_vram_bank_mask) : 0;
+    bool flip_x = ((attr & oam_attr_flip_x) != 0);
+    bool flip_y = ((attr & oam_attr_flip_y) != 0);
+
+    unsigned int sprite_line = m_line.ly - sprite_y;
+
+    if (flip_y)
+    {
+        sprite_line = (sprite_height - 1) - sprite_line;
+    }
+
+    unsigned int tile = (vram_bank * tiles_per_bank) + tile_num + (sprite_line / tile_height);
+
+    SpriteRow sprite_row;
+    sprite_row.row = &m_tile_cache[tile][flip_x][sprite_line % tile_height];
+    sprite_row.x = m_oam[oam_offset + oam_x] - 8;
+    sprite_row.entry_base = obj_palette_entry_base + (pal_slot * 4);
+    sprite_row.low_priority = ((attr & oam_attr_priority) != 0);
+    return sprite_row;
+}
+
+#if defined(GBEMU_SSE2)
+// One bit per pixel of a line buffer, with bit n of the line in bit (n % 64) of word n / 64.
+using PixelMask = std::array<u64, 3>;
+
+// Gets the 8 bits of a mask starting at pos.
+static unsigned int GetPixelMaskBits(const PixelMask& mask, unsigned int pos)
+{
+    unsigned int word = pos / 64;
+    unsigned int shift = pos % 64;
+    u64 bits = mask[word] >> shift;
+
+    if (shift > 64 - 8)
+    {
+        bits |= mask[word + 1] << (64 - shift);
+    }
+
+    return bits & 0xFF;
+}
+
+// Sets 8 bits of a mask starting at pos.
+static void SetPixelMaskBits(PixelMask& mask, unsigned int pos, unsigned int bits)
+{
+    unsigned int word = pos / 64;
+    unsigned int shift = pos % 64;
+    mask[word] |= (u64)bits << shift;
+
+    if (shift > 64 - 8)
+    {
+        mask[word + 1] |= (u64)bits >> (64 - shift);
+    }
+}
+
+// Turns the low 8 bits into a byte mask, with 0xFF in byte n if bit n is set.
+static __m128i ExpandPixelMaskBits(unsigned int bits)
+{
+    const __m128i bit_values = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i selected = _mm_and_si128(_mm_set1_epi8((char)bits), bit_values);
+    return _mm_cmpeq_epi8(selected, bit_values);
+}
+#endif
+
+void Renderer::DrawSprites()
+{
+    UpdateSpriteLists();
+
+    const LineSprites& line_sprites = m_line_sprites[m_line.ly];
+
+    if (line_sprites.count == 0)
+    {
+        return;
+    }
+
+    // Sprites are composited front to back. A pixel is claimed by the first sprite that
+    // is opaque there and not hidden by the background, and later sprites can't replace it.
+#if defined(GBEMU_SSE2)
+    // Where the background hides sprites: any nonzero color hides low priority sprites, and
+    // high priority tiles also hide the rest. These depend only on the line, so they're
+    // worked out once and each sprite just tests its 8 bits.
+    PixelMask hidden_by_bg = {};
+    PixelMask hidden_by_bg_high = {};
+    PixelMask claimed = {};
+
+    if (m_line.bg_enable)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        for (unsigned int pos = 0; pos < line_buffer_size; pos += 16)
+        {
+            __m128i bg_indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_bg_color_indices[pos]));
+            __m128i bg_priority = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_bg_high_priority[pos]));
+            __m128i bg_transparent = _mm_cmpeq_epi8(bg_indices, zero);
+            __m128i bg_low_priority = _mm_cmpeq_epi8(bg_priority, zero);
+
+            u64 transparent_bits = _mm_movemask_epi8(bg_transparent);
+            u64 visible_bits = _mm_movemask_epi8(_mm_or_si128(bg_transparent, bg_low_priority));
+            hidden_by_bg[pos / 64] |= (~transparent_bits & 0xFFFF) << (pos % 64);
+            hidden_by_bg_high[pos / 64] |= (~visible_bits & 0xFFFF) << (pos % 64);
+        }
+    }
+
+    for (int i = 0; i < line_sprites.count; i++)
+    {
+        SpriteRow sprite_row = GetSpriteRow(line_sprites.sprites[i]);
+
+        if (sprite_row.x >= lcd_width)
+        {
+            continue;
+        }
+
+        if (m_tile_grid != nullptr && sprite_row.x > -tile_width)
+        {
+            AddTileGridSprite(line_sprites.sprites[i]);
+        }
+
+        unsigned int pos = line_padding + sprite_row.x;
+        const PixelMask& hidden = sprite_row.low_priority ? hidden_by_bg : hidden_by_bg_high;
+
+        __m128i pixels = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(sprite_row.row->data()));
+        unsigned int transparent = _mm_movemask_epi8(_mm_cmpeq_epi8(pixels, _mm_setzero_si128()));
+        unsigned int claim = ~transparent & ~GetPixelMaskBits(hidden, pos) & ~GetPixelMaskBits(claimed, pos) & 0xFF;
+
+        if (claim == 0)
+        {
+            continue;
+        }
+
+        SetPixelMaskBits(claimed, pos, claim);
+
+        __m128i claim_bytes = ExpandPixelMaskBits(claim);
+        __m128i entries = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&m_line_entries[pos]));
+        __m128i sprite_entries = _mm_or_si128(pixels, _mm_set1_epi8(sprite_row.entry_base));
+        entries = _mm_or_si128(_mm_and_si128(claim_bytes, sprite_entries), _mm_andnot_si128(claim_bytes, entries));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&m_line_entries[pos]), entries);
+    }
+#else
+    std::array<u8, line_buffer_size> taken = {};
+
+    for (int i = 0; i < line_sprites.count; i++)
+    {
+        SpriteRow sprite_row = GetSpriteRow(line_sprites.sprites[i]);
+
+        if (sprite_row.x >= lcd_width)
+        {
+            continue;
+        }
+
+        if (m_tile_grid != nullptr && sprite_row.x > -tile_width)
+        {
+            AddTileGridSprite(line_sprites.sprites[i]);
+        }
+
+        const TileRow& row = *sprite_row.row;
+        u8 entry_base = sprite_row.entry_base;
+        bool low_priority = sprite_row.low_priority;
+        unsigned int pos = line_padding + sprite_row.x;
+
+        for (int fine_x = 0; fine_x < tile_width; fine_x++)
+        {
+            unsigned int x = pos + fine_x;
+            unsigned int pixel = row[fine_x];
+
+            if (!taken[x] && pixel != 0 && (!m_line.bg_enable || (!m_bg_high_priority[x] && !low_priority) || m_bg_color_indices[x] == 0))
+            {
+                m_line_entries[x] = entry_base | pixel;
+                taken[x] = 0xFF;
+            }
+        }
+    }
+#endif
+}
+
+void Renderer::ResetTileGrid()
+{
+    m_tile_grid->cells = {};
+    m_tile_grid->sprite_count = 0;
+    m_tile_grid_sprite_mask = 0;
+}
+
+void Renderer::AddTileGridRow()
+{
+    TileGridCell* cells = &m_tile_grid->cells[(m_line.ly / tile_height) * TileGrid::width];
+    int window_x = m_line.wx - 7;
+
+    for (int i = 0; i < TileGrid::width; i++)
+    {
+        int x = i * tile_width;
+        bool in_window = m_line.window_visible && x >= window_x;
+        TileGridCell cell = {};
+
+        if (!in_window && !m_line.bg_enable && !m_is_cgb_mode)
+        {
+            cell.flags = tile_grid_blank;
+            cells[i] = cell;
+            continue;
+        }
+
+        u16 tilemap_offset;
+        u16 attr_table_offset;
+        unsigned int tile_x;
+        unsigned int tile_y;
+
+        if (in_window)
+        {
+            tilemap_offset = m_line.window_tilemap_offset;
+            attr_table_offset = m_line.window_attr_table_offset;
+            tile_x = (x - window_x) / tile_width;
+            tile_y = m_line.window_line / tile_height;
+            cell.flags = tile_grid_window;
+        }
+        else
+        {
+            tilemap_offset = m_line.bg_tilemap_offset;
+            attr_table_offset = m_line.bg_attr_table_offset;
+            tile_x = ((m_line.scx + x) & 0xFF) / tile_width;
+            tile_y = ((m_line.ly + m_line.scy) & 0xFF) / tile_height;
+        }
+
+        unsigned int map_index = (tile_y * virtual_screen_width) + tile_x;
+        u8 tile_num = m_vram[tilemap_offset + map_index];
+        cell.attr = m_is_cgb_mode ? m_vram[attr_table_offset + map_index] : 0;
+
+        unsigned int vram_bank = (cell.attr >> bg_attr_vram_bank_shift) & bg_attr_vram_bank_mask;
+        unsigned int tile = m_line.pattern_table_8000 ? tile_num : 256 + (s8)tile_num;
+        cell.tile = (vram_bank * tiles_per_bank) + tile;
+        cells[i] = cell;
+    }
+}
+
+void Renderer::AddTileGridSprite(unsigned int sprite_index)
+{
+    u64 bit = 1ULL << sprite_index;
+
+    if ((m_tile_grid_sprite_mask & bit) != 0)
+    {
+        return;
+    }
+
+    m_tile_grid_sprite_mask |= bit;
+
+    const u8* entry = &m_oam[sprite_index * oam_entry_size];
+    TileGridSprite& sprite = m_tile_grid->sprites[m_tile_grid->sprite_count++];
+    sprite.oam_index = sprite_index;
+    sprite.y = entry[oam_y];
+    sprite.x = entry[oam_x];
+    sprite.tile = entry[oam_tile_num];
+    sprite.attr = entry[oam_attr];
+}
+
+void Renderer::ResetLineChanges()
+{
+    m_line_changes.clear();
+}
+
+void Renderer::StorePixel(u8* dst, int x, u8 entry)
+{
+    switch (m_pixel_format)
+    {
+    case PixelFormat::XRGB8888:
+    case PixelFormat::ABGR8888:
+    {
+        u32 color = m_palette[entry];
+        memcpy(&dst[x * 4], &color, sizeof(color));
+        break;
+    }
+    case PixelFormat::RGB565:
+    {
+        u16 color = m_palette[entry];
+        memcpy(&dst[x * 2], &color, sizeof(color));
+        break;
+    }
+    case PixelFormat::Indexed8:
+        dst[x] = static_cast<u8>(m_palette[entry] >> 24);
+        break;
+    }
+}
+
+// Draws the current line one pixel at a time, the way the PPU's pixel FIFO does, applying each
+// change from the pixel it was made at. Background and window tiles are fetched 8 pixels ahead
+// with the registers at the time of the fetch, so a coarse scroll change takes effect at the next
+// tile, while palette and enable bits take effect immediately. Fine scroll is only applied at
+// the start of the line. Without any changes, the output matches DrawScanline().
+void Renderer::DrawChangedLine()
+{
+    const LineRegisters start_regs = m_line;
+    const std::array<u32, 64> end_palette = m_palette;
+    m_palette = m_line_start_palette;
+
+    UpdateTileCache();
+    UpdateSpriteLists();
+
+    // Sprites are selected and fetched with the sprite size the line started with.
+    const LineSprites& line_sprites = m_line_sprites[m_line.ly];
+    std::array<SpriteRow, per_line_sprite_limit> sprite_rows;
+
+    for (int i = 0; i < line_sprites.count; i++)
+    {
+        sprite_rows[i] = GetSpriteRow(line_sprites.sprites[i]);
+    }
+
+    u8* dst = (m_observation == nullptr) ? GetScanlineDestination() : nullptr;
+
+    std::array<u8, tile_width> fifo_colors;
+    std::array<u8, tile_width> fifo_entries;
+    std::array<bool, tile_width> fifo_high_priority;
+    int fifo_pos = tile_width;
+    int discard = m_line.scx & 7;
+    unsigned int bg_fetches = 0;
+    unsigned int window_fetches = 0;
+    bool window_active = false;
+    size_t next_change = 0;
+
+    for (int x = 0; x < lcd_width; x++)
+    {
+        while (next_change < m_line_changes.size() && m_line_changes[next_change].x <= x)
+        {
+            const LineChange& change = m_line_changes[next_change++];
+
+            if (change.is_palette_entry)
+            {
+                m_palette[change.entry] = change.color;
+            }
+            else
+            {
+                m_line = change.regs;
+            }
+        }
+
+        if (!window_active && m_line.window_visible && x >= m_line.wx - 7)
+        {
+            // The window restarts the FIFO. If it starts left of the screen, its first
+            // pixels are dropped.
+            window_active = true;
+            fifo_pos = tile_width;
+            discard = std::max(7 - m_line.wx, 0);
+        }
+
+        if (fifo_pos == tile_width)
+        {
+            const u8* tilemap;
+            const u8* attr_table;
+            unsigned int tile_x;
+            unsigned int line;
+
+            if (window_active)
+            {
+                tilemap = &m_vram[m_line.window_tilemap_offset];
+                attr_table = &m_vram[m_line.window_attr_table_offset];
+                tile_x = window_fetches++;
+                line = m_line.window_line;
+            }
+            else
+            {
+                tilemap = &m_vram[m_line.bg_tilemap_offset];
+                attr_table = &m_vram[m_line.bg_attr_table_offset];
+                tile_x = ((m_line.scx >> 3) + bg_fetches++) % virtual_screen_width;
+                line = (m_line.ly + m_line.scy) & 0xFF;
+            }
+
+            unsigned int tile_y = (line >> 3) % virtual_screen_height;
+            u8 attr = m_is_cgb_mode ? attr_table[(tile_y * virtual_screen_width) + tile_x] : 0;
+            unsigned int pal_slot = (attr >> bg_attr_pal_shift) & bg_attr_pal_mask;
+            unsigned int vram_bank = (attr >> bg_attr_vram_bank_shift) & bg_attr_vram_bank_mask;
+
+            const TileRow& row = GetBackgroundTileRow(
+                tilemap,
+                tile_x,
+                tile_y,
+                line & 7,
+                vram_bank,
+                (attr & bg_attr_flip_x) != 0,
+                (attr & bg_attr_flip_y) != 0);
+
+            for (int i = 0; i < tile_width; i++)
+            {
+                fifo_colors[i] = row[i];
+                fifo_entries[i] = row[i] | (pal_slot * 4);
+                fifo_high_priority[i] = ((attr & bg_attr_priority) != 0);
+            }
+
+            fifo_pos = discard;
+            discard = 0;
+        }
+
+        u8 bg_color = fifo_colors[fifo_pos];
+        u8 entry = fifo_entries[fifo_pos];
+        bool bg_high_priority = fifo_high_priority[fifo_pos];
+        fifo_pos++;
+
+        if (!m_line.bg_enable && !m_is_cgb_mode && !window_active)
+        {
+            bg_color = 0;
+            entry = dmg_blank_palette_entry;
+            bg_high_priority = false;
+        }
+
+        if (m_line.sprite_enable)
+        {
+            for (int i = 0; i < line_sprites.count; i++)
+            {
+                const SpriteRow& sprite_row = sprite_rows[i];
+
+                if (x < sprite_row.x || x >= sprite_row.x + tile_width)
+                {
+                    continue;
+                }
+
+                u8 pixel = (*sprite_row.row)[x - sprite_row.x];
+
+                if (pixel != 0 && (!m_line.bg_enable || (!bg_high_priority && !sprite_row.low_priority) || bg_color == 0))
+                {
+                    entry = sprite_row.entry_base | pixel;
+                    break;
+                }
+            }
+        }
+
+        if (dst != nullptr)
+        {
+            StorePixel(dst, x, entry);
+        }
+        else
+        {
+            m_observation_line[x] = GetObservationValue(entry);
+        }
+    }
+
+    m_line = start_regs;
+    m_palette = end_palette;
+
+    if (dst != nullptr)
+    {
+        m_line_hashes[m_line.ly] = m_replaced_line_hash;
+        UpdateLineHash(dst);
+    }
+}
+
+// Uses the palette as it is at this point in the line, rather than m_palette_luma.
+u8 Renderer::GetObservationValue(u8 entry) const
+{
+    if (m_observation_format == ObservationFormat::Grayscale)
+    {
+        return GetLuma(m_palette[entry], m_pixel_format);
+    }
+
+    return entry;
+}
+
+void Renderer::ResetObservation()
+{
+    std::fill(m_observation_sums.begin(), m_observation_sums.end(), 0.0f);
+    m_observation_line_pending = false;
+}
+
+void Renderer::AddObservationLine()
+{
+    m_observation_line_pending = false;
+
+    if (m_observation_format == ObservationFormat::PaletteEntry)
+    {
+        int row = m_observation_sample_rows[m_line.ly];
+
+        if (row >= 0)
+        {
+            u8* dst = m_observation + (row * m_observation_width);
+
+            for (unsigned int i = 0; i < m_observation_width; i++)
+            {
+                dst[i] = m_observation_line[m_observation_sample_columns[i]];
+            }
+        }
+
+        return;
+    }
+
+    // Horizontal pass: each LCD pixel adds to the one or two output pixels it overlaps.
+    float* row = m_observation_row.data();
+    std::fill(m_observation_row.begin(), m_observation_row.end(), 0.0f);
+
+    for (int x = 0; x < lcd_width; x++)
+    {
+        float val = m_observation_line[x];
+        float weight = m_observation_column_weights[x];
+        unsigned int column = m_observation_columns[x];
+        row[column] += val * weight;
+        row[column + 1] += val * (m_observation_column_weight - weight);
+    }
+
+    // Vertical pass: the line adds to the one or two output rows it overlaps.
+    unsigned int first_row = m_observation_rows[m_line.ly];
+    float weights[2];
+    weights[0] = m_observation_row_weights[m_line.ly];
+    weights[1] = m_observation_row_weight - weights[0];
+
+    for (int i = 0; i < 2; i++)
+    {
+        float* sums = &m_observation_sums[(first_row + i) * m_observation_stride];
+        unsigned int x = 0;
+
+#if defined(GBEMU_SSE2)
+        __m128 weight = _mm_set1_ps(weights[i]);
+
+        for (; x < m_observation_stride; x += 4)
+        {
+            __m128 sum = _mm_loadu_ps(&sums[x]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&row[x]), weight));
+            _mm_storeu_ps(&sums[x], sum);
+        }
+#endif
+
+        for (; x < m_observation_stride; x++)
+        {
+            sums[x] += row[x] * weights[i];
+        }
+    }
+}
+
+void Renderer::FinishObservation()
+{
+    if (m_observation_line_pending)
+    {
+        AddObservationLine();
+    }
+
+    if (m_observation_format != ObservationFormat::Grayscale)
+    {
+        return;
+    }
+
+    std::vector<u8> rounded(m_observation_stride);
+
+    for (unsigned int y = 0; y < m_observation_height; y++)
+    {
+        const float* sums = &m_observation_sums[y * m_observation_stride];
+        unsigned int x = 0;
+
+#if defined(GBEMU_SSE2)
+        for (; x + 8 <= m_observation_stride; x += 8)
+        {
+            __m128i low = _mm_cvtps_epi32(_mm_loadu_ps(&sums[x]));
+            __m128i high = _mm_cvtps_epi32(_mm_loadu_ps(&sums[x + 4]));
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(low, high), _mm_setzero_si128());
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(&rounded[x]), packed);
+        }
+#endif
+
+        for (; x < m_observation_stride; x++)
+        {
+            rounded[x] = (u8)std::min(std::max((int)std::lrint(sums[x]), 0), 255);
+        }
+
+        memcpy(m_observation + (y * m_observation_width), rounded.data(), m_observation_width);
+    }
+}
@@ -0,0 +1,490 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "triple_buffer.h"
+
+const int lcd_width = 160;
+const int lcd_height = 144;
+
+enum class PixelFormat
+{
+    // 32-bit 0x00RRGGBB.
+    XRGB8888,
+    // 32-bit 0xFFBBGGRR.
+    ABGR8888,
+    // 16-bit, with red in the top 5 bits and blue in the bottom 5 bits.
+    RGB565,
+    // 8-bit palette entry. Background pixels are 0-31 (palette * 4 + color) and sprite pixels are
+    // 32-63. In DMG mode, pixels hold the shade BGP, OBP0 or OBP1 mapped them to instead, as 0-3,
+    // 32-35 and 36-39, so the palette doesn't change when those registers are written; entry 4 is
+    // used when the background is disabled. While the LCD is off, every pixel is
+    // lcd_off_palette_entry.
+    Indexed8,
+};
+
+unsigned int GetBytesPerPixel(PixelFormat format);
+
+// A reduced-size image for consumers that don't need the full frame, one byte per pixel.
+enum class ObservationFormat
+{
+    // Luma averaged over the area of the LCD each pixel covers, from 0 (black) to 255 (white).
+    Grayscale,
+    // The palette entry of the LCD pixel at the center of each pixel, as in PixelFormat::Indexed8
+    // but without the DMG palette registers applied.
+    PaletteEntry,
+};
+
+// Storage for one frame, large enough for any pixel format. Rows are packed, so the pitch is
+// lcd_width * GetBytesPerPixel(format) bytes.
+using FramebufferArray = std::array<u32, lcd_width * lcd_height>;
+
+// Indexed8 entry for frames drawn while the LCD is off. Its color is black, as the other formats
+// show those frames.
+const unsigned int lcd_off_palette_entry = 64;
+
+// Colors for Indexed8 frames, in XRGB8888.
+using FramebufferPalette = std::array<u32, lcd_off_palette_entry + 1>;
+
+// One bit per LCD line.
+using LineMask = std::bitset<lcd_height>;
+
+struct Frame
+{
+    FramebufferArray pixels;
+    // The palette when the frame was completed. Only used with PixelFormat::Indexed8.
+    FramebufferPalette palette;
+    // Set if a color in palette changed after the first line was drawn, so lines drawn before the
+    // change may have used a color the palette no longer has. Only happens in CGB mode, unless the
+    // color table is replaced.
+    bool palette_changed;
+    // The value of GetRenderedFrameCount() when the frame was completed, or 0 for the blank frame
+    // after a reset. Gaps mean frames were dropped; a repeated number means no new frame.
+    u64 sequence;
+    // Lines whose output differs from the frame before it (sequence - 1). If any frames in
+    // between were missed, every line has to be treated as changed.
+    LineMask changed_lines;
+};
+
+// A frame described by its tiles instead of its pixels, for consumers that want to know what's on
+// screen without looking at pixels.
+struct TileGridCell
+{
+    // The tile in VRAM, 0-383 in bank 0 and 384-767 in bank 1, with the tile data area applied.
+    u16 tile;
+    // CGB background attributes, or 0 in DMG mode.
+    u8 attr;
+    // tile_grid_* flags.
+    u8 flags;
+};
+
+// The cell shows the window rather than the background.
+const u8 tile_grid_window = 0x01;
+// The background is disabled in DMG mode, so the cell is blank. tile and attr are 0.
+const u8 tile_grid_blank = 0x02;
+
+struct TileGridSprite
+{
+    u8 oam_index;
+    // The OAM entry: Y + 16, X + 8, tile number and attributes.
+    u8 y;
+    u8 x;
+    u8 tile;
+    u8 attr;
+};
+
+struct TileGrid
+{
+    static const int width = lcd_width / 8;
+    static const int height = lcd_height / 8;
+
+    // Rows of cells, each the tile under the top-left pixel of an 8x8 block of the screen,
+    // using the scroll and window registers from the start of the block's first line.
+    std::array<TileGridCell, width * height> cells;
+    // Sprites drawn on at least one line, in the order they first appear.
+    std::array<TileGridSprite, 40> sprites;
+    unsigned int sprite_count;
+    // Frame::sequence of the frame described.
+    u64 sequence;
+};
+
+// Palette entries used by the renderer. Background pixels use 0-31 (palette slot * 4 + color),
+// sprite pixels use 32-63. In DMG mode, entry 4 is the black used when the background is disabled.
+const unsigned int obj_palette_entry_base = 32;
+const unsigned int dmg_blank_palette_entry = 4;
+
+// PPU registers as they were at the start of a line's pixel transfer. VRAM offsets are relative
+// to the start of VRAM bank 0.
+struct LineRegisters
+{
+    u8 ly;
+    u8 scx;
+    u8 scy;
+    // Window X position plus 7, as written to WX.
+    u8 wx;
+    // Window line counter, only meaningful if window_visible is set.
+    u8 window_line;
+    bool bg_enable;
+    bool window_visible;
+    bool sprite_enable;
+    bool sprite_size_8x16;
+    bool pattern_table_8000;
+    u16 bg_tilemap_offset;
+    u16 bg_attr_table_offset;
+    u16 window_tilemap_offset;
+    u16 window_attr_table_offset;
+};
+
+// Draws frames from a log of VRAM, OAM and palette writes and per-line register snapshots. The
+// renderer keeps its own copies of VRAM and OAM, so the log can be replayed on a worker thread
+// while the emulation carries on with the next frame. Without the worker, every command is
+// carried out immediately.
+class Renderer
+{
+public:
+    explicit Renderer(bool is_cgb_mode);
+    ~Renderer();
+
+    // Starts or stops the worker thread. Stopping it first waits for outstanding work.
+    void SetThreaded(bool threaded);
+
+    bool IsThreaded() const
+    {
+        return m_worker.joinable();
+    }
+
+    // Waits until every command recorded so far has been carried out, so that the frames and
+    // host framebuffer are up to date.
+    void Sync();
+
+    // Commands. They take effect in the order they are recorded.
+    void WriteVRAM(u16 offset, u8 val);
+    void WriteOAM(u16 offset, u8 val);
+    // color is in the output pixel format. For Indexed8, it's XRGB8888 with the index that pixels
+    // using the entry are written as in the top byte.
+    void SetPaletteEntry(unsigned int entry, u32 color);
+    void BeginFrame();
+    void DrawLine(const LineRegisters& regs);
+    // Registers written while the last line drawn was being output, taking effect from pixel x.
+    // Palette entries set after this, until the line is redrawn, also take effect from x.
+    void ChangeLineRegisters(unsigned int x, const LineRegisters& regs);
+    // Draws the last line again pixel by pixel, applying the changes.
+    void RedrawChangedLine();
+    // Publishes the frame being drawn.
+    void EndFrame(u64 sequence);
+    // Publishes a blank frame and blanks the host framebuffer.
+    void ClearFrame(u64 sequence);
+
+    // These wait for outstanding work first.
+    void LoadMemory(const std::array<u8, 0x4000>& vram, const std::array<u8, 0xA0>& oam);
+    void ClearFramebuffers();
+    void SetPixelFormat(PixelFormat format);
+    void SetHostFramebuffer(void* pixels, unsigned int pitch);
+    // See Graphics::SetObservationBuffer().
+    bool SetObservationBuffer(u8* buffer, unsigned int width, unsigned int height, ObservationFormat format);
+    // See Graphics::SetTileGrid().
+    void SetTileGrid(TileGrid* grid);
+
+    unsigned int GetFramebufferPitch() const
+    {
+        return lcd_width * GetBytesPerPixel(m_pixel_format);
+    }
+
+    // Consumer side of the frame triple buffer. See Graphics::AcquireFrame().
+    const Frame& AcquireFrame()
+    {
+        m_frames.Acquire();
+        return m_frames.GetFront();
+    }
+
+    const FramebufferPalette& GetFramebufferPalette() const
+    {
+        return m_frames.GetFront().palette;
+    }
+
+private:
+    static const int virtual_screen_width = 32;
+    static const int virtual_screen_height = 32;
+    static const int tile_width = 8;
+    static const int tile_height = 8;
+    static const int tiles_per_bank = 384;
+    static const int total_tiles = tiles_per_bank * 2;
+    static constexpr int per_line_sprite_limit = 10;
+    static const int line_padding = tile_width;
+    static const int line_buffer_size = line_padding + lcd_width + tile_width;
+    static const int layer_size = virtual_screen_width * tile_width;
+    static const int layer_cells = virtual_screen_width * virtual_screen_height;
+
+    // Recorded commands are handed to the worker at the end of each frame, or sooner if this
+    // many pile up.
+    static const size_t max_recorded_commands = 0x10000;
+
+    // One row of a tile decoded to 2-bit color indices, one byte per pixel.
+    using TileRow = std::array<u8, tile_width>;
+
+    // Rows of a tile, unflipped ([0]) and flipped horizontally ([1]).
+    using DecodedTile = std::array<std::array<TileRow, tile_height>, 2>;
+
+    // OAM indices of the sprites drawn on a line, highest priority first.
+    struct LineSprites
+    {
+        int count;
+        std::array<u8, per_line_sprite_limit> sprites;
+    };
+
+    // The row of a sprite that falls on the current line.
+    struct SpriteRow
+    {
+        const TileRow* row;
+        int x;
+        u8 entry_base;
+        bool low_priority;
+    };
+
+    // The background or window drawn in full from one of the two tilemaps, in the same form as
+    // the line buffers. Cells are redrawn when they're next needed after their tilemap entry,
+    // attributes or tile data change. Entries don't depend on the palette colors.
+    struct Layer
+    {
+        std::array<u8, layer_size * layer_size> entries;
+        std::array<u8, layer_size * layer_size> color_indices;
+        std::array<u8, layer_size * layer_size> high_priority;
+
+        // The tile each cell was drawn from and that tile's version at the time.
+        std::array<u16, layer_cells> cell_tiles;
+        std::array<u32, layer_cells> cell_tile_versions;
+        std::array<bool, layer_cells> cell_dirty;
+
+        // Rows of cells known to be up to date as of m_tile_data_generation.
+        std::array<u32, virtual_screen_height> row_generations;
+        std::array<bool, virtual_screen_height> row_dirty;
+
+        bool pattern_table_8000;
+    };
+
+    // A register or palette change in the middle of a line.
+    struct LineChange
+    {
+        u8 x;
+        bool is_palette_entry;
+        u8 entry;
+        u32 color;
+        LineRegisters regs;
+    };
+
+    enum class CommandType : u8
+    {
+        WriteVRAM,
+        WriteOAM,
+        SetPaletteEntry,
+        BeginFrame,
+        DrawLine,
+        ChangeLineRegisters,
+        RedrawChangedLine,
+        EndFrame,
+        ClearFrame,
+    };
+
+    struct Command
+    {
+        struct MemoryWrite
+        {
+            u16 offset;
+            u8 val;
+        };
+
+        struct PaletteWrite
+        {
+            u32 entry;
+            u32 color;
+        };
+
+        struct RegisterChange
+        {
+            u8 x;
+            LineRegisters regs;
+        };
+
+        CommandType type;
+        union
+        {
+            MemoryWrite memory_write;
+            PaletteWrite palette_write;
+            LineRegisters line;
+            RegisterChange register_change;
+            u64 sequence;
+        };
+    };
+
+    void Record(const Command& command);
+    void Execute(const Command& command);
+    void Submit();
+    void StopWorker();
+    void WorkerLoop();
+
+    void SetIndexedColor(u32 color);
+    void ExecuteEndFrame(u64 sequence);
+    void ExecuteClearFrame(u64 sequence);
+    void MarkTileDirty(unsigned int vram_offset);
+    void MarkAllTilesDirty();
+    void UpdateTileCache();
+    void MarkLayerCellDirty(unsigned int vram_offset);
+    void MarkAllLayersDirty();
+    Layer& GetLayer(u16 tilemap_offset);
+    void UpdateLayerRow(Layer& layer, u16 tilemap_offset, u16 attr_table_offset, unsigned int tile_y);
+    void CopyLayerRow(const Layer& layer, unsigned int layer_x, unsigned int layer_y, int x);
+    const TileRow& GetBackgroundTileRow(
+        const u8* tilemap,
+        unsigned int tile_x,
+        unsigned int tile_y,
+        unsigned int tile_fine_y,
+        unsigned int vram_bank,
+        bool flip_x,
+        bool flip_y);
+    void DrawBackground();
+    void DrawWindow();
+    void UpdateSpriteLists();
+    SpriteRow GetSpriteRow(unsigned int sprite_index);
+    void DrawSprites();
+    void WhiteOutScanline();
+    u8* GetScanlineDestination();
+    void ResolveScanline(u8* dst);
+    void InvalidateLineHashes();
+    void UpdateLineHash(const u8* dst);
+    void DrawScanline();
+    void ResetLineChanges();
+    void StorePixel(u8* dst, int x, u8 entry);
+    void DrawChangedLine();
+    u8 GetObservationValue(u8 entry) const;
+    void ResetObservation();
+    void AddObservationLine();
+    void FinishObservation();
+    void ResetTileGrid();
+    void AddTileGridRow();
+    void AddTileGridSprite(unsigned int sprite_index);
+
+    const bool m_is_cgb_mode;
+
+    // Copies of VRAM and OAM as of the command being carried out.
+    std::array<u8, 0x4000> m_vram;
+    std::array<u8, 0xA0> m_oam;
+
+    // Registers of the line being drawn.
+    LineRegisters m_line;
+
+    // Tile data from both VRAM banks, decoded when a tile is next drawn after being written.
+    std::array<DecodedTile, total_tiles> m_tile_cache;
+    std::array<bool, total_tiles> m_tile_dirty;
+    bool m_any_tile_dirty;
+
+    // Incremented when a tile's data is written, and m_tile_data_generation when any is.
+    std::array<u32, total_tiles> m_tile_versions;
+    u32 m_tile_data_generation;
+
+    // Layers for the 9800 and 9C00 tilemaps, kept on the heap because of their size.
+    std::vector<Layer> m_layers;
+
+    // Per-line sprite lists, rebuilt before drawing when OAM or the sprite size has changed.
+    std::array<LineSprites, lcd_height> m_line_sprites;
+    bool m_sprite_lists_dirty;
+    bool m_sprite_lists_8x16;
+
+    PixelFormat m_pixel_format;
+    TripleBuffer<Frame> m_frames;
+    u8* m_host_framebuffer;
+    unsigned int m_host_framebuffer_pitch;
+
+    // Hash of each line's output in the last drawn frame, used to fill in Frame::changed_lines.
+    // The hash the current line replaced is kept in case the line is redrawn.
+    std::array<u64, lcd_height> m_line_hashes;
+    u64 m_replaced_line_hash;
+
+    // Changes to the current line, in order, with the palette from when the line was drawn.
+    std::vector<LineChange> m_line_changes;
+    std::array<u32, 64> m_line_start_palette;
+
+    // Colors for the scanline buffer entries in the output pixel format.
+    std::array<u32, 64> m_palette;
+    // Luma of each palette entry, for grayscale observations.
+    std::array<u8, 64> m_palette_luma;
+    // Indexed8 colors by the index written, for Frame::palette, and whether one changed after a
+    // line of the current frame was drawn.
+    FramebufferPalette m_indexed_palette;
+    bool m_indexed_palette_changed;
+    bool m_frame_lines_drawn;
+
+    // Observation output. While it's enabled, lines aren't resolved to pixels.
+    u8* m_observation;
+    unsigned int m_observation_width;
+    unsigned int m_observation_height;
+    ObservationFormat m_observation_format;
+    // The values of the last line drawn, which is only added to the observation once the next
+    // line starts or the frame ends, since it may still be redrawn.
+    std::array<u8, lcd_width> m_observation_line;
+    bool m_observation_line_pending;
+    // For each LCD pixel, the first output column it overlaps and its weight there. Any
+    // remaining weight goes to the next column. Rows are the same with LCD lines.
+    std::array<u8, lcd_width> m_observation_columns;
+    std::array<float, lcd_width> m_observation_column_weights;
+    std::array<u8, lcd_height> m_observation_rows;
+    std::array<float, lcd_height> m_observation_row_weights;
+    float m_observation_column_weight;
+    float m_observation_row_weight;
+    // For palette entries, the LCD column each output column takes, and the output row each
+    // LCD line goes to, or -1.
+    std::array<u8, lcd_width> m_observation_sample_columns;
+    std::array<int, lcd_height> m_observation_sample_rows;
+    // Weighted sums for each output pixel, with rows padded to a multiple of 4.
+    unsigned int m_observation_stride;
+    std::vector<float> m_observation_row;
+    std::vector<float> m_observation_sums;
+
+    TileGrid* m_tile_grid;
+    // One bit per OAM entry already added to the tile grid this frame.
+    u64 m_tile_grid_sprite_mask;
+
+    // The current scanline, with room for one tile on each side so that whole tiles can be
+    // stored without clipping. Entries index m_palette; the background color indices and
+    // priority masks (0xFF when set) are kept for sprite priority resolution.
+    std::array<u8, line_buffer_size> m_line_entries;
+    std::array<u8, line_buffer_size> m_bg_color_indices;
+    std::array<u8, line_buffer_size> m_bg_high_priority;
+
+    // Commands recorded by the emulation thread since the last submission.
+    std::vector<Command> m_recorded;
+
+    // Worker state. m_submitted holds at most one batch waiting for the worker, so the
+    // emulation can't get more than a frame or so ahead of it.
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_work_done;
+    std::vector<Command> m_submitted;
+    bool m_worker_busy;
+    bool m_stop_worker;
+};
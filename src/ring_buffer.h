@@ -0,0 +1,193 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// A fixed-capacity queue between one producer thread and one consumer thread. Neither side ever
+// waits: writes are cut short when the queue is full and reads when it's empty.
+template<typename T>
+class RingBuffer
+{
+public:
+    // The capacity is rounded up to a power of 2.
+    explicit RingBuffer(size_t capacity)
+    {
+        size_t size = 1;
+
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+
+        m_items.resize(size);
+        m_mask = size - 1;
+        Reset();
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    size_t GetCapacity() const
+    {
+        return m_items.size();
+    }
+
+    // The number of items waiting to be read. Can be called from either side, and is only a
+    // snapshot if the other side is active.
+    size_t GetSize() const
+    {
+        size_t read_pos = m_read_pos.load(std::memory_order_acquire);
+        return m_write_pos.load(std::memory_order_acquire) - read_pos;
+    }
+
+    // Not thread-safe. Only call while neither side is using the queue.
+    void Reset()
+    {
+        m_write_pos.store(0, std::memory_order_relaxed);
+        m_read_pos.store(0, std::memory_order_relaxed);
+        m_cached_read_pos = 0;
+        m_cached_write_pos = 0;
+    }
+
+    // Producer side.
+
+    size_t GetWriteAvailable()
+    {
+        size_t write_pos = m_write_pos.load(std::memory_order_relaxed);
+        m_cached_read_pos = m_read_pos.load(std::memory_order_acquire);
+        return GetCapacity() - (write_pos - m_cached_read_pos);
+    }
+
+    // Writes up to count items and returns how many were written.
+    size_t Write(const T* items, size_t count)
+    {
+        size_t write_pos = m_write_pos.load(std::memory_order_relaxed);
+
+        // The consumer's position is only reloaded when the last one seen doesn't leave room.
+        if (GetCapacity() - (write_pos - m_cached_read_pos) < count)
+        {
+            m_cached_read_pos = m_read_pos.load(std::memory_order_acquire);
+        }
+
+        count = std::min(count, GetCapacity() - (write_pos - m_cached_read_pos));
+
+        size_t start = write_pos & m_mask;
+        size_t first_part = std::min(count, GetCapacity() - start);
+        std::copy(items, items + first_part, m_items.begin() + start);
+        std::copy(items + first_part, items + count, m_items.begin());
+
+        m_write_pos.store(write_pos + count, std::memory_order_release);
+        return count;
+    }
+
+    // Returns the next free slot to be filled in place, or nullptr if the queue is full.
+    // The item is only visible to the consumer after EndWrite().
+    T* BeginWrite()
+    {
+        size_t write_pos = m_write_pos.load(std::memory_order_relaxed);
+
+        if (write_pos - m_cached_read_pos == GetCapacity())
+        {
+            m_cached_read_pos = m_read_pos.load(std::memory_order_acquire);
+
+            if (write_pos - m_cached_read_pos == GetCapacity())
+            {
+                return nullptr;
+            }
+        }
+
+        return &m_items[write_pos & m_mask];
+    }
+
+    void EndWrite()
+    {
+        m_write_pos.store(m_write_pos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side.
+
+    size_t GetReadAvailable()
+    {
+        m_cached_write_pos = m_write_pos.load(std::memory_order_acquire);
+        return m_cached_write_pos - m_read_pos.load(std::memory_order_relaxed);
+    }
+
+    // Reads up to count items and returns how many were read.
+    size_t Read(T* items, size_t count)
+    {
+        size_t read_pos = m_read_pos.load(std::memory_order_relaxed);
+
+        if (m_cached_write_pos - read_pos < count)
+        {
+            m_cached_write_pos = m_write_pos.load(std::memory_order_acquire);
+        }
+
+        count = std::min(count, m_cached_write_pos - read_pos);
+
+        size_t start = read_pos & m_mask;
+        size_t first_part = std::min(count, GetCapacity() - start);
+        std::copy(m_items.begin() + start, m_items.begin() + start + first_part, items);
+        std::copy(m_items.begin(), m_items.begin() + (count - first_part), items + first_part);
+
+        m_read_pos.store(read_pos + count, std::memory_order_release);
+        return count;
+    }
+
+    // Returns the oldest item without removing it, or nullptr if the queue is empty.
+    const T* BeginRead()
+    {
+        size_t read_pos = m_read_pos.load(std::memory_order_relaxed);
+
+        if (m_cached_write_pos == read_pos)
+        {
+            m_cached_write_pos = m_write_pos.load(std::memory_order_acquire);
+
+            if (m_cached_write_pos == read_pos)
+            {
+                return nullptr;
+            }
+        }
+
+        return &m_items[read_pos & m_mask];
+    }
+
+    // Removes the item returned by BeginRead(), after which its slot may be reused.
+    void EndRead()
+    {
+        m_read_pos.store(m_read_pos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> m_items;
+    size_t m_mask;
+
+    // Positions count up without wrapping and are masked when used. Each side keeps its own
+    // position and a copy of the other side's on its own cache line, so the line with the
+    // other side's position is only touched when the copy has run out.
+    alignas(64) std::atomic<size_t> m_write_pos;
+    size_t m_cached_read_pos;
+    alignas(64) std::atomic<size_t> m_read_pos;
+    size_t m_cached_write_pos;
+};
@@ -24,7 +24,20 @@
 
 struct Hardware;
 
-class Timer
+// Mutable timer state. Kept trivially copyable so it can be snapshotted with a plain copy.
+struct TimerState
+{
+    u16 m_counter;
+    int m_selected_bit_index;
+    int m_selected_bit_value;
+
+    u8 m_reg_tima;
+    u8 m_reg_tma;
+    unsigned int m_timer_clock_select;
+    bool m_timer_enable;
+};
+
+class Timer : private TimerState
 {
 public:
     explicit Timer(Hardware& hw) : m_hw(hw)
@@ -47,17 +60,18 @@ public:
 
     void Update(unsigned int cycles);
 
+    void SaveState(TimerState& state) const
+    {
+        state = *this;
+    }
+
+    void LoadState(const TimerState& state)
+    {
+        static_cast<TimerState&>(*this) = state;
+    }
+
 private:
     int CalcSelectedBitValue();
 
     Hardware& m_hw;
-
-    u16 m_counter;
-    int m_selected_bit_index;
-    int m_selected_bit_value;
-
-    u8 m_reg_tima;
-    u8 m_reg_tma;
-    unsigned int m_timer_clock_select;
-    bool m_timer_enable;
 };
@@ -0,0 +1,97 @@
+// Copyright 2019 David Brotz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+
+// Hands the most recently completed buffer from one producer thread to one consumer thread
+// without either side waiting. The producer fills the back buffer and publishes it. The consumer
+// takes the newest published buffer, and the producer never writes into the buffer it holds.
+template<typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+    {
+        Reset();
+    }
+
+    // Not thread-safe. Only call while neither side is using the buffers.
+    void Reset()
+    {
+        m_back = 0;
+        m_mailbox.store(1, std::memory_order_relaxed);
+        m_front = 2;
+    }
+
+    // Not thread-safe. Only call while neither side is using the buffers.
+    std::array<T, 3>& GetBuffers()
+    {
+        return m_buffers;
+    }
+
+    // Producer side.
+
+    T& GetBack()
+    {
+        return m_buffers[m_back];
+    }
+
+    void Publish()
+    {
+        unsigned int old = m_mailbox.exchange(m_back | fresh_bit, std::memory_order_acq_rel);
+        m_back = old & index_mask;
+    }
+
+    // Consumer side.
+
+    // Makes the newest published buffer the front buffer. Returns false if nothing was
+    // published since the last call, in which case the front buffer is unchanged.
+    bool Acquire()
+    {
+        if ((m_mailbox.load(std::memory_order_relaxed) & fresh_bit) == 0)
+        {
+            return false;
+        }
+
+        unsigned int old = m_mailbox.exchange(m_front, std::memory_order_acq_rel);
+        m_front = old & index_mask;
+        return true;
+    }
+
+    const T& GetFront() const
+    {
+        return m_buffers[m_front];
+    }
+
+private:
+    static const unsigned int index_mask = 0x3;
+    static const unsigned int fresh_bit = 0x4;
+
+    std::array<T, 3> m_buffers;
+
+    // Each index is owned by one side. The mailbox holds the third buffer's index, plus
+    // fresh_bit if it was published and hasn't been acquired yet.
+    alignas(64) unsigned int m_back;
+    alignas(64) std::atomic<unsigned int> m_mailbox;
+    alignas(64) unsigned int m_front;
+};